@@ -4,22 +4,27 @@
 #include "interrupts.h"
 #include "alarm.h"
 #include "minithread.h"
-#include "queue.h"
+#include "heap.h"
+#include "slab.h"
 
 //External variable for the number of interrupts
 extern long long int nInterrupts;
-//Alarm priority queue
-queue_t *alarm_queue = NULL;
+//Alarm priority queue, a min-heap keyed on the alarm end time
+heap_t *alarm_heap = NULL;
+//Object cache for alarms
+static slab_cache_t *alarm_cache = NULL;
 
 /*
  * Alarm structure - Contains alarm end time, alarm handler function 
  * and the argument to that function which is basically the
- * thread_t pointer for now
+ * thread_t pointer for now. The heap node is embedded so that an
+ * alarm can be removed from the heap directly through its handle.
  */
 struct alarm {
   long long int end;
   alarm_handler_t call_back;
   void *arg;
+  heap_node_t node;
 };
 
 /*
@@ -36,7 +41,8 @@ static void alarm_call_back(void *arg)
  */
 void alarm_system_initialize()
 {
-  alarm_queue = queue_new();
+  alarm_heap = heap_new();
+  alarm_cache = slab_cache_create("alarm_t", sizeof(alarm_t), NULL);
 }
 
 /* see alarm.h */
@@ -52,9 +58,9 @@ register_alarm(int delay, alarm_handler_t alarm, void *arg)
     del = del + 1;
   }
 
-  alarm_t *newAlarm = (alarm_t *) malloc(sizeof(alarm_t));
+  alarm_t *newAlarm = (alarm_t *) slab_alloc(alarm_cache);
 
-  if (!newAlarm) {      //If malloc fails
+  if (!newAlarm) {      //If the allocation fails
     return NULL;
   }
 
@@ -62,8 +68,13 @@ register_alarm(int delay, alarm_handler_t alarm, void *arg)
   newAlarm->call_back = alarm;
   newAlarm->arg = arg;
   interrupt_level_t old_level = set_interrupt_level(DISABLED);
-  queue_insert_sorted(alarm_queue, newAlarm, newAlarm->end);    //Insert the alarm into the priority queue
+  int result = heap_insert(alarm_heap, &newAlarm->node, newAlarm->end);    //Insert the alarm into the priority queue
   set_interrupt_level(old_level);
+
+  if (result == -1) {
+    slab_free(alarm_cache, newAlarm);
+    return NULL;
+  }
   return newAlarm;
 }
 
@@ -76,17 +87,17 @@ deregister_alarm(alarm_id alarm)
   
   if (a->end <= nInterrupts) {      //If the alarm went off, return 1 after deleting it from the queue
   	interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    queue_delete(alarm_queue, a);   
+    heap_delete(alarm_heap, &a->node);
     set_interrupt_level(old_level);
-    free (a);
+    slab_free(alarm_cache, a);
     a = NULL;
     return 1;
   }
   else {                            //Alarm did not go off, return 0 after deleting it from the queue
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
-    queue_delete(alarm_queue, a);
+    heap_delete(alarm_heap, &a->node);
     set_interrupt_level(old_level);
-    free (a);
+    slab_free(alarm_cache, a);
     a = NULL;
     return 0;
   }
@@ -98,10 +109,15 @@ deregister_alarm(alarm_id alarm)
 alarm_t* get_next_alarm()
 {
   interrupt_level_t old_level = set_interrupt_level(DISABLED);	
-  alarm_t *next = (alarm_t *) queue_front(alarm_queue);
+  heap_node_t *node = heap_peek(alarm_heap);
   set_interrupt_level(old_level);
-  
-  if (next && next->end == nInterrupts) {   //If the alarm is not NULL and it is supposed to go off at this time, return it
+
+  if (!node) {
+    return NULL;
+  }
+
+  alarm_t *next = heap_entry(node, alarm_t, node);
+  if (next->end <= nInterrupts) {   //If the alarm is supposed to go off at this time (or is overdue), return it
     return next;
   }
 
@@ -0,0 +1,388 @@
+/*****
+ * Packet capture implementation.
+ *
+ */
+#include "capture.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CAPTURE_RING_SIZE 4096       /* slots, a power of two */
+
+/* pcap-ng block types and options, see the pcap-ng specification */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define LINKTYPE_RAW 101
+
+#define IP_HEADER_LEN 20
+#define UDP_HEADER_LEN 8
+
+/*
+ * A slot of the ring. seq tells producers and the consumer whose turn it
+ * is: a slot at position pos is free when seq == pos and full when
+ * seq == pos + 1 (Vyukov's bounded queue).
+ */
+typedef struct {
+  unsigned int seq;
+  int direction;
+  int flags;
+  int len;
+  long long int timestamp;
+  network_address_t src;
+  network_address_t dest;
+  char data[CAPTURE_SNAPLEN];
+} capture_slot_t;
+
+typedef struct {
+  capture_slot_t *slots;
+  unsigned int enqueue_pos __attribute__((aligned(64)));
+  unsigned int dequeue_pos __attribute__((aligned(64)));
+  int waiting;
+  int doorbell;
+  int producers;              /* taps between their capture_active check and their seq store */
+  long long int lost;
+  FILE *file;
+  pthread_t writer;
+} capture_t;
+
+volatile int capture_active = 0;
+static capture_t capture;
+
+static int futex(int* uaddr, int op, int val)
+{
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/*
+ * Copy a packet into the next free slot. Never blocks: if the ring is full
+ * the packet is only counted. The tap counts itself in capture.producers
+ * before it looks at capture_active, so that stop and start can wait until
+ * no tap is still writing into the ring.
+ */
+void capture_packet(int direction, int flags,
+                    const network_address_t src, const network_address_t dest,
+                    const struct iovec* iov, int iovcnt, int len)
+{
+  struct timespec ts;
+  capture_slot_t *slot;
+  unsigned int pos;
+  int i, n, copied;
+
+  if (!capture_active) {
+    return;
+  }
+  __atomic_add_fetch(&capture.producers, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&capture_active, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&capture.producers, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  pos = __atomic_load_n(&capture.enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &capture.slots[pos & (CAPTURE_RING_SIZE - 1)];
+    int diff = (int) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&capture.enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      __atomic_add_fetch(&capture.lost, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&capture.producers, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+    else {
+      pos = __atomic_load_n(&capture.enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  slot->timestamp = (long long int) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  slot->direction = direction;
+  slot->flags = flags;
+  slot->len = len;
+  network_address_copy(src, slot->src);
+  network_address_copy(dest, slot->dest);
+  copied = 0;
+  for (i = 0; i < iovcnt && copied < CAPTURE_SNAPLEN; i++) {
+    n = iov[i].iov_len;
+    if (n > CAPTURE_SNAPLEN - copied) {
+      n = CAPTURE_SNAPLEN - copied;
+    }
+    memcpy(slot->data + copied, iov[i].iov_base, n);
+    copied += n;
+  }
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&capture.producers, 1, __ATOMIC_SEQ_CST);
+
+  /* wake the writer only if it has said it is about to sleep */
+  if (__atomic_load_n(&capture.waiting, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&capture.doorbell, 1, __ATOMIC_SEQ_CST);
+    futex(&capture.doorbell, FUTEX_WAKE, 1);
+  }
+}
+
+/*
+ * Write a block: type, total length, body padded to 32 bits, total length.
+ */
+static void capture_write_block(uint32_t type, const void *body, uint32_t len)
+{
+  static const char zero[4] = { 0 };
+  uint32_t padded = (len + 3) & ~3;
+  uint32_t total = padded + 12;
+
+  fwrite(&type, 4, 1, capture.file);
+  fwrite(&total, 4, 1, capture.file);
+  fwrite(body, 1, len, capture.file);
+  fwrite(zero, 1, padded - len, capture.file);
+  fwrite(&total, 4, 1, capture.file);
+}
+
+/* append an option to buf at *len, padded to 32 bits */
+static void capture_option(char *buf, uint32_t *len, uint16_t code,
+                           const void *value, uint16_t value_len)
+{
+  memcpy(buf + *len, &code, 2);
+  memcpy(buf + *len + 2, &value_len, 2);
+  memcpy(buf + *len + 4, value, value_len);
+  memset(buf + *len + 4 + value_len, 0, ((value_len + 3) & ~3) - value_len);
+  *len += 4 + ((value_len + 3) & ~3);
+}
+
+static void capture_write_headers()
+{
+  char buf[64];
+  uint32_t len;
+  uint32_t u32;
+  uint16_t u16;
+  int64_t section_length = -1;
+  uint8_t tsresol = 9;        /* nanoseconds */
+
+  /* section header block */
+  u32 = PCAPNG_BYTE_ORDER;
+  memcpy(buf, &u32, 4);
+  u16 = 1;
+  memcpy(buf + 4, &u16, 2);
+  u16 = 0;
+  memcpy(buf + 6, &u16, 2);
+  memcpy(buf + 8, &section_length, 8);
+  len = 16;
+  capture_option(buf, &len, PCAPNG_OPT_END, NULL, 0);
+  capture_write_block(PCAPNG_SHB, buf, len);
+
+  /* interface description block */
+  u16 = LINKTYPE_RAW;
+  memcpy(buf, &u16, 2);
+  u16 = 0;
+  memcpy(buf + 2, &u16, 2);
+  u32 = IP_HEADER_LEN + UDP_HEADER_LEN + CAPTURE_SNAPLEN;
+  memcpy(buf + 4, &u32, 4);
+  len = 8;
+  capture_option(buf, &len, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+  capture_option(buf, &len, PCAPNG_OPT_END, NULL, 0);
+  capture_write_block(PCAPNG_IDB, buf, len);
+}
+
+/* make up the IPv4 and UDP headers of a captured packet */
+static void capture_ip_udp(char *buf, const capture_slot_t *slot)
+{
+  uint16_t total = IP_HEADER_LEN + UDP_HEADER_LEN + slot->len;
+  uint16_t udp_len = UDP_HEADER_LEN + slot->len;
+  uint32_t sum = 0;
+  int i;
+
+  memset(buf, 0, IP_HEADER_LEN + UDP_HEADER_LEN);
+  buf[0] = 0x45;                         /* IPv4, 20 byte header */
+  total = htons(total);
+  memcpy(buf + 2, &total, 2);
+  buf[8] = 64;                           /* ttl */
+  buf[9] = 17;                           /* UDP */
+  memcpy(buf + 12, &slot->src[0], 4);    /* addresses are in network order */
+  memcpy(buf + 16, &slot->dest[0], 4);
+  for (i = 0; i < IP_HEADER_LEN; i += 2) {
+    sum += ((unsigned char) buf[i] << 8) | (unsigned char) buf[i + 1];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  buf[10] = (~sum >> 8) & 0xff;
+  buf[11] = ~sum & 0xff;
+
+  memcpy(buf + IP_HEADER_LEN, &slot->src[1], 2);     /* ports too */
+  memcpy(buf + IP_HEADER_LEN + 2, &slot->dest[1], 2);
+  udp_len = htons(udp_len);
+  memcpy(buf + IP_HEADER_LEN + 4, &udp_len, 2);
+}
+
+static void capture_write_packet(const capture_slot_t *slot)
+{
+  char buf[20 + IP_HEADER_LEN + UDP_HEADER_LEN + CAPTURE_SNAPLEN + 128];
+  uint32_t caplen = slot->len < CAPTURE_SNAPLEN ? slot->len : CAPTURE_SNAPLEN;
+  uint32_t u32;
+  uint32_t len;
+  char comment[64];
+
+  u32 = 0;                                          /* interface */
+  memcpy(buf, &u32, 4);
+  u32 = (uint32_t) ((uint64_t) slot->timestamp >> 32);
+  memcpy(buf + 4, &u32, 4);
+  u32 = (uint32_t) slot->timestamp;
+  memcpy(buf + 8, &u32, 4);
+  u32 = IP_HEADER_LEN + UDP_HEADER_LEN + caplen;
+  memcpy(buf + 12, &u32, 4);
+  u32 = IP_HEADER_LEN + UDP_HEADER_LEN + slot->len;
+  memcpy(buf + 16, &u32, 4);
+  capture_ip_udp(buf + 20, slot);
+  memcpy(buf + 20 + IP_HEADER_LEN + UDP_HEADER_LEN, slot->data, caplen);
+  len = 20 + IP_HEADER_LEN + UDP_HEADER_LEN + caplen;
+  while (len & 3) {
+    buf[len++] = 0;
+  }
+
+  u32 = (slot->direction == CAPTURE_IN) ? 1 : 2;   /* inbound, outbound */
+  capture_option(buf, &len, PCAPNG_OPT_EPB_FLAGS, &u32, 4);
+  if (slot->flags & (CAPTURE_DROPPED | CAPTURE_DUPLICATE)) {
+    sprintf(comment, "%s (%s)",
+            (slot->flags & CAPTURE_DROPPED) ? "dropped" : "duplicate",
+            (slot->flags & CAPTURE_EMULATOR) ? "emulator" : "synthetic network");
+    capture_option(buf, &len, PCAPNG_OPT_COMMENT, comment, strlen(comment));
+  }
+  capture_option(buf, &len, PCAPNG_OPT_END, NULL, 0);
+  capture_write_block(PCAPNG_EPB, buf, len);
+}
+
+/* write out the full slots; returns how many there were */
+static int capture_drain()
+{
+  capture_slot_t *slot;
+  int n = 0;
+
+  for (;;) {
+    unsigned int pos = capture.dequeue_pos;
+    slot = &capture.slots[pos & (CAPTURE_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      return n;
+    }
+    capture_write_packet(slot);
+    __atomic_store_n(&slot->seq, pos + CAPTURE_RING_SIZE, __ATOMIC_RELEASE);
+    capture.dequeue_pos = pos + 1;
+    n++;
+  }
+}
+
+/*
+ * The writer thread: empties the ring, and sleeps on the doorbell when
+ * there is nothing to write.
+ */
+static void *capture_writer(void *arg)
+{
+  int doorbell;
+
+  while (__atomic_load_n(&capture_active, __ATOMIC_ACQUIRE)) {
+    if (capture_drain() > 0) {
+      continue;
+    }
+    fflush(capture.file);
+
+    /* announce that we will sleep, then look once more before we do */
+    doorbell = __atomic_load_n(&capture.doorbell, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&capture.waiting, 1, __ATOMIC_SEQ_CST);
+    if (capture_drain() == 0 && __atomic_load_n(&capture_active, __ATOMIC_ACQUIRE)) {
+      futex(&capture.doorbell, FUTEX_WAIT, doorbell);
+    }
+    __atomic_store_n(&capture.waiting, 0, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+/* wait until no tap is between its capture_active check and its seq store */
+static void capture_quiesce()
+{
+  while (__atomic_load_n(&capture.producers, __ATOMIC_SEQ_CST) != 0) {
+    sched_yield();
+  }
+}
+
+int network_capture_start(const char *filename)
+{
+  sigset_t set, old_set;
+  unsigned int i;
+
+  if (capture_active || !filename) {
+    return -1;
+  }
+
+  if (!capture.slots) {
+    capture.slots = (capture_slot_t *) malloc(CAPTURE_RING_SIZE * sizeof(capture_slot_t));
+    if (!capture.slots) {
+      return -1;
+    }
+  }
+  capture_quiesce();
+  for (i = 0; i < CAPTURE_RING_SIZE; i++) {
+    capture.slots[i].seq = i;
+  }
+  capture.enqueue_pos = 0;
+  capture.dequeue_pos = 0;
+  capture.waiting = 0;
+  capture.lost = 0;
+
+  capture.file = fopen(filename, "wb");
+  if (!capture.file) {
+    return -1;
+  }
+  capture_write_headers();
+
+  /* like the network poll thread, the writer must not take interrupts */
+  __atomic_store_n(&capture_active, 1, __ATOMIC_RELEASE);
+  sigemptyset(&set);
+  sigaddset(&set, SIGRTMAX-1);
+  sigaddset(&set, SIGRTMAX-2);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+  if (pthread_create(&capture.writer, NULL, capture_writer, NULL) != 0) {
+    capture_active = 0;
+    fclose(capture.file);
+    capture.file = NULL;
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  return 0;
+}
+
+long long int network_capture_stop()
+{
+  if (!capture_active) {
+    return -1;
+  }
+
+  __atomic_store_n(&capture_active, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&capture.doorbell, 1, __ATOMIC_SEQ_CST);
+  futex(&capture.doorbell, FUTEX_WAKE, 1);
+  pthread_join(capture.writer, NULL);
+
+  /* taps that saw capture_active set may still be filling slots */
+  capture_quiesce();
+  capture_drain();
+  fclose(capture.file);
+  capture.file = NULL;
+  return capture.lost;
+}
@@ -0,0 +1,58 @@
+/*
+ * Packet capture to pcap-ng files
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <sys/uio.h>
+#include "network.h"
+
+/*
+ * While a capture is running, every packet that the network layer sends or
+ * receives is written to a pcap-ng file, with a nanosecond timestamp, its
+ * direction, and a comment for packets that the synthetic network or the
+ * emulator dropped or duplicated. Packets are wrapped in made-up IPv4 and
+ * UDP headers carrying the real addresses and ports, so that ordinary tools
+ * can follow the flows; portos.lua teaches Wireshark the PortOS headers.
+ *
+ * Taps may be called from any thread. They copy the first CAPTURE_SNAPLEN
+ * bytes of the packet into a lock-free ring and never block; a writer
+ * thread empties the ring into the file. Packets that find the ring full
+ * are not captured, and counted.
+ */
+#define CAPTURE_SNAPLEN 256
+
+/* direction of a captured packet */
+enum { CAPTURE_IN = 1, CAPTURE_OUT };
+
+/* annotations of a captured packet */
+#define CAPTURE_DROPPED   0x1
+#define CAPTURE_DUPLICATE 0x2
+#define CAPTURE_EMULATOR  0x4
+
+/*
+ * Start capturing into the named file, which is truncated.
+ * Returns 0 (success) or -1 (failure, e.g. a capture is already running).
+ */
+int network_capture_start(const char* filename);
+
+/*
+ * Stop capturing, write out every packet captured so far and close the
+ * file. Waits for taps that are still copying a packet into the ring, so
+ * a minithread calling it must have interrupts enabled. Returns the number of packets that were lost because the ring was
+ * full, or -1 if no capture was running.
+ */
+long long int network_capture_stop();
+
+/* Is a capture running? Cheap enough to guard every tap with. */
+extern volatile int capture_active;
+
+/*
+ * The tap. src and dest are the addresses of the packet as it travels,
+ * and iov its iovcnt parts, of len bytes in total.
+ */
+void capture_packet(int direction, int flags,
+                    const network_address_t src, const network_address_t dest,
+                    const struct iovec* iov, int iovcnt, int len);
+
+#endif /*__CAPTURE_H__*/
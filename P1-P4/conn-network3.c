@@ -2,8 +2,12 @@
  *    conn-network test program 3
  *	  10 concurrent connections between two machines exchange big messages.
  *    usage: conn-network3 [<hostname>]
+ *           conn-network3 <sourceport> <destport> [<hostname>]
  *    if no hostname is supplied, server will be run
  *    if a hostname is given, the client application will be run
+ *    with ports given, the server and the client can run on the same
+ *    computer, e.g. "conn-network3 8000 8001" and
+ *    "conn-network3 8001 8000 localhost"
  *    Make experiments with different values for BUFFER_SIZE
 */
 
@@ -11,6 +15,8 @@
 #include "minisocket.h"
 #include "synch.h"
 
+#include <stdlib.h>
+
 const size_t BUFFER_SIZE = 100000;
 const size_t THREAD_COUNTER = 5;
 
@@ -118,6 +124,11 @@ int receiver(int* arg) {
 }
 
 int main(int argc, char** argv) {
+    if (argc > 2) {
+        network_udp_ports(atoi(argv[1]), atoi(argv[2]));
+        argc -= 2;
+        argv += 2;
+    }
     if (argc > 1) {
         hostname = argv[1];
         minithread_system_initialize(client, NULL);
@@ -0,0 +1,213 @@
+/*****
+ * Generic intrusive binary min-heap implementation.
+ *
+ */
+#include "heap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define HEAP_INITIAL_CAPACITY 16
+
+/*
+ * The heap is an array of node pointers laid out as a complete binary tree.
+ * Every node remembers its own position in the array, which is what makes
+ * deletion by handle possible without a search.
+ */
+struct heap {
+  heap_node_t **nodes;
+  int count;
+  int capacity;
+  unsigned long long int next_seq;
+};
+
+/*
+ * Returns 1 if node a should come out of the heap before node b.
+ * Equal keys are ordered by insertion sequence to keep FIFO behavior.
+ */
+static int heap_less(heap_node_t *a, heap_node_t *b)
+{
+  if (a->key != b->key) {
+    return a->key < b->key;
+  }
+  return a->seq < b->seq;
+}
+
+/*
+ * Place node at position i of the array and record the position in the node
+ */
+static void heap_set(heap_t *heap, int i, heap_node_t *node)
+{
+  heap->nodes[i] = node;
+  node->index = i;
+}
+
+/*
+ * Move the node at position i up until its parent is smaller
+ */
+static void heap_sift_up(heap_t *heap, int i)
+{
+  heap_node_t *node = heap->nodes[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!heap_less(node, heap->nodes[parent])) {
+      break;
+    }
+    heap_set(heap, i, heap->nodes[parent]);
+    i = parent;
+  }
+  heap_set(heap, i, node);
+}
+
+/*
+ * Move the node at position i down until both its children are larger
+ */
+static void heap_sift_down(heap_t *heap, int i)
+{
+  heap_node_t *node = heap->nodes[i];
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= heap->count) {
+      break;
+    }
+    if (child + 1 < heap->count && heap_less(heap->nodes[child + 1], heap->nodes[child])) {
+      child++;
+    }
+    if (!heap_less(heap->nodes[child], node)) {
+      break;
+    }
+    heap_set(heap, i, heap->nodes[child]);
+    i = child;
+  }
+  heap_set(heap, i, node);
+}
+
+/*
+ * Return an empty heap.
+ */
+heap_t *heap_new()
+{
+  heap_t *heap = (heap_t *) malloc(sizeof(heap_t));
+  if (!heap) {
+    return NULL;
+  }
+  heap->nodes = (heap_node_t **) malloc(HEAP_INITIAL_CAPACITY * sizeof(heap_node_t *));
+  if (!heap->nodes) {
+    free(heap);
+    return NULL;
+  }
+  heap->count = 0;
+  heap->capacity = HEAP_INITIAL_CAPACITY;
+  heap->next_seq = 0;
+  return heap;
+}
+
+/*
+ * Insert a node with the given key. The array is doubled when full.
+ * Return 0 (success) or -1 (failure).
+ */
+int heap_insert(heap_t *heap, heap_node_t *node, long long int key)
+{
+  if (!heap || !node) {
+    return -1;
+  }
+
+  if (heap->count == heap->capacity) {
+    heap_node_t **nodes = (heap_node_t **) realloc(heap->nodes,
+                                                   2 * heap->capacity * sizeof(heap_node_t *));
+    if (!nodes) {
+      return -1;
+    }
+    heap->nodes = nodes;
+    heap->capacity *= 2;
+  }
+
+  node->key = key;
+  node->seq = heap->next_seq++;
+  heap_set(heap, heap->count, node);
+  heap->count++;
+  heap_sift_up(heap, heap->count - 1);
+  return 0;
+}
+
+/*
+ * Delete the specified node from the heap. The last node is moved into
+ * the hole and then sifted in whichever direction restores the order.
+ * Return -1 if the node is not in this heap.
+ */
+int heap_delete(heap_t *heap, heap_node_t *node)
+{
+  assert(heap && node);
+  int i = node->index;
+
+  if (i < 0 || i >= heap->count || heap->nodes[i] != node) {
+    return -1;
+  }
+
+  heap->count--;
+  node->index = -1;
+  if (i == heap->count) {   // the node was the last one in the array
+    return 0;
+  }
+
+  heap_set(heap, i, heap->nodes[heap->count]);
+  if (i > 0 && heap_less(heap->nodes[i], heap->nodes[(i - 1) / 2])) {
+    heap_sift_up(heap, i);
+  }
+  else {
+    heap_sift_down(heap, i);
+  }
+  return 0;
+}
+
+/*
+ * Return the smallest node without removing it
+ */
+heap_node_t *heap_peek(heap_t *heap)
+{
+  assert(heap);
+
+  if (heap->count == 0)
+    return NULL;
+  else
+    return heap->nodes[0];
+}
+
+/*
+ * Remove and return the smallest node. Return 0 (success) or -1 (failure).
+ */
+int heap_extract_min(heap_t *heap, heap_node_t **node)
+{
+  assert(heap);
+
+  if (heap->count == 0) {
+    *node = NULL;
+    return -1;
+  }
+  *node = heap->nodes[0];
+  return heap_delete(heap, *node);
+}
+
+/*
+ * Return the number of nodes in the heap.
+ */
+int heap_length(const heap_t *heap)
+{
+  assert(heap);
+  return heap->count;
+}
+
+/*
+ * Free the heap and return 0 (success) or -1 (failure).
+ */
+int heap_free(heap_t *heap)
+{
+  assert(heap);
+  // non-empty heap should error
+  if (heap->count) {
+    return -1;
+  }
+  free(heap->nodes);
+  free(heap);
+  return 0;
+}
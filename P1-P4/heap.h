@@ -0,0 +1,78 @@
+/*
+ * Generic intrusive min-heap (priority queue) functions
+ */
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include <stddef.h>
+
+/*
+ * heap_t is a pointer to an internally maintained data structure.
+ * Clients of this package do not need to know how heaps are
+ * represented.  They see and manipulate only heap_t's.
+ */
+typedef struct heap heap_t;
+
+/*
+ * The heap is intrusive: every item that is kept in a heap embeds a
+ * heap_node_t, and the heap only ever stores pointers to these nodes.
+ * The node doubles as the handle used for O(log n) deletion, so no
+ * search and no per-insert allocation is needed. Clients should not
+ * touch the fields directly.
+ */
+typedef struct heap_node {
+  long long int key;
+  unsigned long long int seq;
+  int index;
+} heap_node_t;
+
+/*
+ * Get back the item which embeds the node, e.g.
+ *   alarm_t *a = heap_entry(node, alarm_t, node);
+ */
+#define heap_entry(node, type, member) \
+  ((type *) ((char *) (node) - offsetof(type, member)))
+
+/*
+ * Return an empty heap.  Returns NULL on error.
+ */
+heap_t* heap_new();
+
+/*
+ * Insert a node into the heap with the given key. Nodes with equal keys
+ * come out in the order they were inserted.
+ * Returns 0 (success) or -1 (failure).
+ */
+int heap_insert(heap_t* heap, heap_node_t* node, long long int key);
+
+/*
+ * Remove the specified node from the heap.
+ * Returns 0 if the node was deleted, or -1 if it was not in the heap.
+ */
+int heap_delete(heap_t* heap, heap_node_t* node);
+
+/*
+ * Return the node with the smallest key without removing it, or NULL
+ * if the heap is empty. Runs in O(1).
+ */
+heap_node_t* heap_peek(heap_t* heap);
+
+/*
+ * Remove and return the node with the smallest key.
+ * Return 0 (success) and the node if the heap is nonempty, or -1 (failure)
+ * and NULL if the heap is empty.
+ */
+int heap_extract_min(heap_t* heap, heap_node_t** node);
+
+/*
+ * Return the number of nodes in the heap
+ */
+int heap_length(const heap_t* heap);
+
+/*
+ * Free the heap and return 0 (success) or -1 (failure).
+ * Failure cases include NULL heap and non-empty heap.
+ */
+int heap_free(heap_t* heap);
+
+#endif /*__HEAP_H__*/
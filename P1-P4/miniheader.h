@@ -7,11 +7,18 @@
 #include "network.h"
 
 /* protocol types */
-enum { PROTOCOL_MINIDATAGRAM = 1, PROTOCOL_MINISTREAM };
+enum { PROTOCOL_MINIDATAGRAM = 1, PROTOCOL_MINISTREAM, PROTOCOL_MINIFRAGMENT, PROTOCOL_MINIRDP,
+       PROTOCOL_MINIGROUP };
 
 /* message types for minisockets */
 enum { MSG_SYN = 1, MSG_SYNACK, MSG_ACK, MSG_FIN };
 
+/* message types for reliable datagrams */
+enum { RDP_DATA = 1, RDP_ACK };
+
+/* message types for remote procedure calls */
+enum { RPC_REQUEST = 1, RPC_RESPONSE, RPC_SHUTDOWN };
+
 /* header definition for unreliable packets */
 typedef struct mini_header
 {
@@ -42,6 +49,74 @@ typedef struct mini_header_reliable
 
 } mini_header_reliable_t;
 
+/* header definition for the fragments of large datagrams, note the overlap with mini_header_t */
+typedef struct mini_header_fragment
+{
+    char protocol;
+
+    char source_address[8];
+    char source_port[2];
+
+    char destination_address[8];
+    char destination_port[2];
+
+    char message_id[4];
+    char fragment_index[2];
+    char fragment_count[2];
+    char message_length[4];
+
+} mini_header_fragment_t;
+
+/* header definition for datagrams sent to a multicast group, note the overlap with mini_header_t */
+typedef struct mini_header_group
+{
+    char protocol;
+
+    char source_address[8];
+    char source_port[2];
+
+    char destination_address[8];
+    char destination_port[2];
+
+    char group_id[4];
+
+} mini_header_group_t;
+
+/*
+ * header definition for reliable datagrams and their acknowledgments, note the
+ * overlap with mini_header_t. In a datagram, window_base is the oldest sequence
+ * number that the sender may still retransmit; in an acknowledgment, it is the
+ * oldest one not received yet, and bit i of ack_bits (most significant byte
+ * first) says whether window_base + i has been.
+ */
+typedef struct mini_header_rdp
+{
+    char protocol;
+
+    char source_address[8];
+    char source_port[2];
+
+    char destination_address[8];
+    char destination_port[2];
+
+    char message_type;
+    char flow_id[4];
+    char seq_number[4];
+    char window_base[4];
+    char ack_bits[8];
+
+} mini_header_rdp_t;
+
+/* header definition for remote procedure calls, at the start of the payload of a reliable datagram */
+typedef struct mini_header_rpc
+{
+    char message_type;
+    char call_id[4];
+    char procedure[2];
+    char status;
+
+} mini_header_rpc_t;
+
 /* packs a native unsigned short into 2 bytes in network byte order */
 void pack_unsigned_short(char *buf, unsigned short val);
 
@@ -3,20 +3,40 @@
  */
 #include "minimsg.h"
 #include "interrupts.h"
+#include "slab.h"
+#include "portalloc.h"
+#include "alarm.h"
+#include "machineprimitives.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 
 #define N_TRUE 1
 #define N_FALSE 0
 
+//Number of reply ports minimsg_receive keeps for repeat senders, and its hash table size
+#define REPLY_CACHE_SIZE 256
+#define REPLY_CACHE_BUCKETS 512
+
+//Size of the hash table of the groups that local ports have joined
+#define GROUP_BUCKETS 256
+
+//Most fragments a message can have
+#define MAX_FRAGMENTS ((MINIMSG_MAX_LARGE_MSG_SIZE + MINIMSG_FRAGMENT_SIZE - 1) / MINIMSG_FRAGMENT_SIZE)
+
+typedef struct reassembly reassembly_t;
+typedef struct group_membership group_membership_t;
+
 /*
   * The miniport structure. Contains a field p_type which is 'u' for unbound ports and
   * and 'b' for bound ports. p_number holds the port number. Contains a union of bounded
   * and unbounded port types. Unbounded ports have a data queue and a semaphore to indicate
-  * the availability of datagrams. Bounded ports have a remote network address and a remote
-  * port number to which the data is being sent
+  * the availability of datagrams; the unbound port of a port group hands its datagrams on
+  * to the queues of its members, which are unbound ports of the same number. Bounded ports have a remote network address and a remote
+  * port number to which the data is being sent, and a header already packed for them, in
+  * which only the source port changes from one send to the next
   */
 struct miniport
 {
@@ -28,40 +48,469 @@ struct miniport
     {
       queue_t *data;
       semaphore_t *data_ready;
+      //Large messages of which only some fragments have arrived
+      reassembly_t *reassembly;
+      //What is on the data queue, the limits on it (0 for none), and what was dropped
+      int queued_packets;
+      int queued_bytes;
+      int max_packets;
+      int max_bytes;
+      int policy;
+      long long int dropped_packets;
+      long long int dropped_bytes;
+      //The members of a port group (NULL for an ordinary port), how datagrams are
+      //spread over them, and the next one in turn
+      miniport_t **members;
+      int member_count;
+      int group_policy;
+      unsigned int next_member;
+      //For a member, the group it belongs to, which alone may destroy it
+      miniport_t *group;
+      //The multicast groups the port has joined
+      group_membership_t *memberships;
     } unbound_t;
     struct
     {
       network_address_t remote_addr;
       int remote_unbound_port;
+      mini_header_t header;
+      //References handed out; the port is freed when they are all destroyed
+      //and it is not in the reply cache
+      int refcount;
+      int cached;
+      miniport_t *hash_next;
+      miniport_t *lru_prev;
+      miniport_t *lru_next;
     } bound_t;
   };
 };
  
-//The number of bound ports. Wraps around to 0 when the count reaches MAX_PORTS
-int nPorts;		
-//An integer array that holds N_TRUE if the bounded port number is not in use and N_FALSE
-//otherwise
-int bound_ports_free[MAX_PORTS];
+//Hands out bound port numbers incrementally, wrapping around past the ones in use
+static port_allocator_t *bound_ports;
 //The array of unbound ports. Used by the network handler in minithreads library to access
 //a particular port and signal the threads waiting on that port.
 miniport_t *unbound_ports[MAX_PORTS];
-//Mutex variable for modifying the shared datastructures - nPorts, bound_ports_free
-//Since it is allowed to disable interrupts for creating unbound ports, we don't use 
-//a semaphore for the same
-semaphore_t *mutex;
+//Object cache for miniports
+static slab_cache_t *miniport_cache;
+//Batch that minimsg_send_many queues datagrams on; used with interrupts disabled
+static network_batch_t *send_batch;
+//Our own address, the source address of every datagram
+static network_address_t local_host;
+
+/*
+ * The reply cache: the bound ports minimsg_receive created for recent
+ * senders, by (address, port), so that a repeat sender gets the same port
+ * back. Least recently used first out. Protected by disabling interrupts.
+ */
+static miniport_t *reply_buckets[REPLY_CACHE_BUCKETS];
+static miniport_t *lru_head;
+static miniport_t *lru_tail;
+static int reply_cached;
+
+/*
+ * A large message being put back together. It is allocated whole when its
+ * first fragment arrives, with room for a datagram header and the full
+ * payload after the packet argument, so that once complete it is queued on
+ * its port as if it were a single packet. Its header carries the fragment
+ * protocol, which is how datagram_release tells it from a network packet.
+ * Partial messages are on the list of their port, and on a list of all of
+ * them, oldest first, for timing out. Protected by disabling interrupts.
+ */
+struct reassembly
+{
+  network_address_t source_address;
+  int source_port;
+  unsigned int message_id;
+  int count;
+  int received;
+  int length;
+  uint64_t deadline;
+  unsigned char have[(MAX_FRAGMENTS + 7) / 8];
+  miniport_t *port;
+  reassembly_t *port_next;
+  reassembly_t *age_prev;
+  reassembly_t *age_next;
+  network_interrupt_arg_t arg;
+  char buffer[];
+};
+
+static reassembly_t *age_head;
+static reassembly_t *age_tail;
+static int reassembly_bytes;
+//Alarm that goes off when the oldest partial message times out, if there is one
+static alarm_id reassembly_timer;
+//Message id of the next large message we send
+static unsigned int next_message_id;
+
+/*
+ * A local unbound port's membership of a multicast group. Memberships are
+ * in a hash table by group id, and on a list of their port. Protected by
+ * disabling interrupts.
+ */
+struct group_membership
+{
+  unsigned int id;
+  miniport_t *port;
+  group_membership_t *group_next;
+  group_membership_t *port_next;
+};
+
+static group_membership_t *group_buckets[GROUP_BUCKETS];
+
+//The handle for sending to a multicast group, with its header packed once
+struct minimsg_group
+{
+  unsigned int id;
+  mini_header_group_t header;
+  network_address_t *hosts;
+  int host_count;
+  int host_capacity;
+};
+
+//Bytes of datagrams on the data queues of all ports, and the most there may be
+static int buffered_bytes;
+static int memory_budget = MINIMSG_DEFAULT_MEMORY_BUDGET;
 
 void
 minimsg_initialize()
 {
-  //Initialize nPorts to 0 and the global mutex to 1, bound_ports_free to N_TRUE and unbound_ports to NULL
-  nPorts = 0;
-  mutex = semaphore_create();
-  semaphore_initialize(mutex, 1);
+  miniport_cache = slab_cache_create("miniport_t", sizeof(miniport_t), NULL);
+  network_get_my_address(local_host);
+  send_batch = network_batch_new();
+
+  //All bound port numbers start out free, and there are no unbound ports
+  bound_ports = port_allocator_new(MIN_BOUND_PORT, MAX_BOUND_PORT - MIN_BOUND_PORT + 1);
   for(int i=0; i<MAX_PORTS; i++)
     {
-      bound_ports_free[i] = N_TRUE;
       unbound_ports[i] = NULL;
     }
+
+  for(int i=0; i<REPLY_CACHE_BUCKETS; i++)
+    reply_buckets[i] = NULL;
+  lru_head = NULL;
+  lru_tail = NULL;
+  reply_cached = 0;
+
+  age_head = NULL;
+  age_tail = NULL;
+  reassembly_bytes = 0;
+  next_message_id = 0;
+  reassembly_timer = NULL;
+
+  for(int i=0; i<GROUP_BUCKETS; i++)
+    group_buckets[i] = NULL;
+}
+
+static unsigned int source_hash(const network_address_t addr, int port)
+{
+  unsigned int h = addr[0] * 2654435761u;
+  h ^= addr[1] * 40503u;
+  h ^= port * 2246822519u;
+  return h ^ (h >> 15);
+}
+
+static unsigned int reply_hash(const network_address_t addr, int port)
+{
+  return source_hash(addr, port) % REPLY_CACHE_BUCKETS;
+}
+
+static void lru_unlink(miniport_t *port)
+{
+  if (port->bound_t.lru_prev)
+    port->bound_t.lru_prev->bound_t.lru_next = port->bound_t.lru_next;
+  else
+    lru_head = port->bound_t.lru_next;
+  if (port->bound_t.lru_next)
+    port->bound_t.lru_next->bound_t.lru_prev = port->bound_t.lru_prev;
+  else
+    lru_tail = port->bound_t.lru_prev;
+}
+
+static void lru_push_front(miniport_t *port)
+{
+  port->bound_t.lru_prev = NULL;
+  port->bound_t.lru_next = lru_head;
+  if (lru_head)
+    lru_head->bound_t.lru_prev = port;
+  else
+    lru_tail = port;
+  lru_head = port;
+}
+
+/*
+ * Find the reply port of a sender, take a reference to it and make it the
+ * most recently used. Called with interrupts disabled.
+ */
+static miniport_t *reply_cache_lookup(const network_address_t addr, int port_number)
+{
+  miniport_t *port = reply_buckets[reply_hash(addr, port_number)];
+  for (; port; port = port->bound_t.hash_next) {
+    if (port->bound_t.remote_unbound_port == port_number &&
+        network_compare_network_addresses(port->bound_t.remote_addr, addr)) {
+      port->bound_t.refcount++;
+      lru_unlink(port);
+      lru_push_front(port);
+      return port;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Add a port to the cache. If that overflows the cache, the least recently
+ * used port leaves it; it is returned if nobody holds a reference to it
+ * any more, to be freed by the caller. Called with interrupts disabled.
+ */
+static miniport_t *reply_cache_insert(miniport_t *port)
+{
+  miniport_t **bucket = &reply_buckets[reply_hash(port->bound_t.remote_addr,
+                                                  port->bound_t.remote_unbound_port)];
+  miniport_t *victim = NULL;
+
+  port->bound_t.cached = N_TRUE;
+  port->bound_t.hash_next = *bucket;
+  *bucket = port;
+  lru_push_front(port);
+  reply_cached++;
+
+  if (reply_cached > REPLY_CACHE_SIZE) {
+    victim = lru_tail;
+    lru_unlink(victim);
+    bucket = &reply_buckets[reply_hash(victim->bound_t.remote_addr,
+                                       victim->bound_t.remote_unbound_port)];
+    while (*bucket != victim)
+      bucket = &(*bucket)->bound_t.hash_next;
+    *bucket = victim->bound_t.hash_next;
+    victim->bound_t.cached = N_FALSE;
+    reply_cached--;
+    if (victim->bound_t.refcount > 0)
+      victim = NULL;
+  }
+  return victim;
+}
+
+//Give a bound port's number back and free the port
+static void miniport_free_bound(miniport_t *miniport)
+{
+  port_allocator_put(bound_ports, miniport->p_number);
+  slab_free(miniport_cache, miniport);
+}
+
+/*
+ * Take a partial message off its port's list and the age list, and account
+ * for its memory. Called with interrupts disabled.
+ */
+static void reassembly_unlink(reassembly_t *r)
+{
+  reassembly_t **link = &r->port->unbound_t.reassembly;
+  while (*link != r)
+    link = &(*link)->port_next;
+  *link = r->port_next;
+
+  if (r->age_prev)
+    r->age_prev->age_next = r->age_next;
+  else
+    age_head = r->age_next;
+  if (r->age_next)
+    r->age_next->age_prev = r->age_prev;
+  else
+    age_tail = r->age_prev;
+
+  reassembly_bytes -= sizeof(reassembly_t) + sizeof(mini_header_t) + r->length;
+}
+
+static void reassembly_timeout(void *arg);
+
+/*
+ * Give up the partial messages that have timed out, and make sure that the
+ * alarm will go off for the oldest of the rest, so that they time out even
+ * if no more fragments arrive. Called with interrupts disabled.
+ */
+static void reassembly_expire(uint64_t now)
+{
+  while (age_head && age_head->deadline <= now) {
+    reassembly_t *r = age_head;
+    reassembly_unlink(r);
+    free(r);
+  }
+  if (age_head && !reassembly_timer) {
+    reassembly_timer = register_alarm((int) (age_head->deadline - now), reassembly_timeout, NULL);
+  }
+}
+
+//Alarm handler: the oldest partial message may have timed out
+static void reassembly_timeout(void *arg)
+{
+  //The alarm goes away by itself once it has gone off
+  reassembly_timer = NULL;
+  reassembly_expire(currentTimeMillis());
+}
+
+//Release a datagram taken off a port's data queue: a network packet, or a reassembled message
+static void datagram_release(network_interrupt_arg_t *arg)
+{
+  if (arg->buffer[0] == PROTOCOL_MINIFRAGMENT + '0') {
+    free((char *) arg - offsetof(reassembly_t, arg));
+  }
+  else {
+    network_packet_release(arg);
+  }
+}
+
+//Take the oldest datagram off a port's data queue. Called with interrupts disabled.
+static network_interrupt_arg_t *port_dequeue(miniport_t *port)
+{
+  network_interrupt_arg_t *arg = NULL;
+  if (queue_dequeue(port->unbound_t.data, (void **) &arg) == -1) {
+    return NULL;
+  }
+  port->unbound_t.queued_packets--;
+  port->unbound_t.queued_bytes -= arg->size;
+  buffered_bytes -= arg->size;
+  return arg;
+}
+
+//Whether a datagram came in reliably (minirdp.h), and has been acknowledged
+static int datagram_is_reliable(network_interrupt_arg_t *arg)
+{
+  return arg->buffer[0] == PROTOCOL_MINIRDP + '0';
+}
+
+static void port_drop(miniport_t *port, network_interrupt_arg_t *arg)
+{
+  port->unbound_t.dropped_packets++;
+  port->unbound_t.dropped_bytes += arg->size;
+  datagram_release(arg);
+}
+
+/*
+ * Queue an arriving datagram on a port, within the limits of the port and
+ * the global budget. Over the port's limits, drop-head makes room by
+ * dropping the oldest datagrams, as long as they have not been promised to
+ * a receiver and were not received reliably; otherwise, and over the global
+ * budget, the arriving datagram is dropped. Returns 0 if the datagram was
+ * queued, -1 if it was dropped. Called with interrupts disabled.
+ */
+static int port_enqueue(miniport_t *port, network_interrupt_arg_t *arg)
+{
+  int max_packets = port->unbound_t.max_packets;
+  int max_bytes = port->unbound_t.max_bytes;
+
+  if ((max_bytes > 0 && arg->size > max_bytes) || buffered_bytes + arg->size > memory_budget) {
+    port_drop(port, arg);
+    return -1;
+  }
+
+  while ((max_packets > 0 && port->unbound_t.queued_packets + 1 > max_packets)
+         || (max_bytes > 0 && port->unbound_t.queued_bytes + arg->size > max_bytes)) {
+    //Only datagrams that no receiver has claimed yet by P'ing the semaphore can go
+    //and the sender of a reliable datagram has been told that it arrived
+    if (port->unbound_t.policy != MINIPORT_DROP_HEAD
+        || semaphore_get_count(port->unbound_t.data_ready) <= 0
+        || datagram_is_reliable(queue_front(port->unbound_t.data))) {
+      port_drop(port, arg);
+      return -1;
+    }
+    semaphore_P(port->unbound_t.data_ready);
+    port_drop(port, port_dequeue(port));
+  }
+
+  queue_append(port->unbound_t.data, arg);
+  port->unbound_t.queued_packets++;
+  port->unbound_t.queued_bytes += arg->size;
+  buffered_bytes += arg->size;
+  semaphore_V(port->unbound_t.data_ready);
+  return 0;
+}
+
+/*
+ * Queue an arriving datagram on a port or, for a port group, on one of its
+ * members: the next in turn, or the one that the sender's address and port
+ * hash to, so that each sender's datagrams stay in order. Returns 0 if the
+ * datagram was queued, -1 if it was dropped. Called with interrupts
+ * disabled.
+ */
+static int port_deliver(miniport_t *port, network_interrupt_arg_t *arg)
+{
+  if (port->unbound_t.members) {
+    unsigned int member;
+    if (port->unbound_t.group_policy == MINIPORT_GROUP_SOURCE_HASH) {
+      mini_header_t *header = (mini_header_t *) arg->buffer;
+      network_address_t source_address;
+      unpack_address(header->source_address, source_address);
+      member = source_hash(source_address, unpack_unsigned_short(header->source_port));
+    }
+    else {
+      member = port->unbound_t.next_member++;
+    }
+    port = port->unbound_t.members[member % port->unbound_t.member_count];
+  }
+  return port_enqueue(port, arg);
+}
+
+int
+miniport_get_number(miniport_t* port)
+{
+  return port->p_number;
+}
+
+int
+miniport_get_remote(miniport_t* port, network_address_t addr)
+{
+  if (!port || port->p_type != 'b') {
+    return -1;
+  }
+  network_address_copy(port->bound_t.remote_addr, addr);
+  return port->bound_t.remote_unbound_port;
+}
+
+int
+miniport_set_queue_limits(miniport_t* port, int max_packets, int max_bytes, int policy)
+{
+  if (!port || port->p_type != 'u' || max_packets < 0 || max_bytes < 0
+      || (policy != MINIPORT_DROP_TAIL && policy != MINIPORT_DROP_HEAD)) {
+    return -1;
+  }
+  //A port group queues nothing itself: the limits are for each of its members
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int count = port->unbound_t.members ? port->unbound_t.member_count : 1;
+  for (int i = 0; i < count; i++) {
+    miniport_t *queue = port->unbound_t.members ? port->unbound_t.members[i] : port;
+    queue->unbound_t.max_packets = max_packets;
+    queue->unbound_t.max_bytes = max_bytes;
+    queue->unbound_t.policy = policy;
+  }
+  set_interrupt_level(old_level);
+  return 0;
+}
+
+int
+miniport_get_queue_stats(miniport_t* port, miniport_queue_stats_t* stats)
+{
+  if (!port || port->p_type != 'u' || !stats) {
+    return -1;
+  }
+  //The stats of a port group are those of its members added up
+  memset(stats, 0, sizeof(miniport_queue_stats_t));
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int count = port->unbound_t.members ? port->unbound_t.member_count : 1;
+  for (int i = 0; i < count; i++) {
+    miniport_t *queue = port->unbound_t.members ? port->unbound_t.members[i] : port;
+    stats->queued_packets += queue->unbound_t.queued_packets;
+    stats->queued_bytes += queue->unbound_t.queued_bytes;
+    stats->dropped_packets += queue->unbound_t.dropped_packets;
+    stats->dropped_bytes += queue->unbound_t.dropped_bytes;
+  }
+  set_interrupt_level(old_level);
+  return 0;
+}
+
+void
+minimsg_set_memory_budget(int bytes)
+{
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  memory_budget = (bytes > 0) ? bytes : MINIMSG_DEFAULT_MEMORY_BUDGET;
+  set_interrupt_level(old_level);
 }
 
 queue_t* minimsg_get_data_queue(int arg)
@@ -74,6 +523,46 @@ semaphore_t* minimsg_get_semaphore(int arg)
   return unbound_ports[arg]->unbound_t.data_ready;
 }
 
+// Set the type to unbounded, initialize the data queue, and the waiting semaphore to 0
+static void miniport_init_unbound(miniport_t *port, int port_number)
+{
+  port->p_type = 'u';
+  port->p_number = port_number;
+  port->unbound_t.data = queue_new();
+  port->unbound_t.reassembly = NULL;
+  port->unbound_t.queued_packets = 0;
+  port->unbound_t.queued_bytes = 0;
+  port->unbound_t.max_packets = 0;
+  port->unbound_t.max_bytes = 0;
+  port->unbound_t.policy = MINIPORT_DROP_TAIL;
+  port->unbound_t.dropped_packets = 0;
+  port->unbound_t.dropped_bytes = 0;
+  port->unbound_t.members = NULL;
+  port->unbound_t.member_count = 0;
+  port->unbound_t.group_policy = 0;
+  port->unbound_t.next_member = 0;
+  port->unbound_t.group = NULL;
+  port->unbound_t.memberships = NULL;
+  port->unbound_t.data_ready = semaphore_create();
+  semaphore_initialize(port->unbound_t.data_ready, 0);
+}
+
+//Empty the data queue of an unbound port that the network can no longer reach, and free it
+static void miniport_free_unbound(miniport_t *port)
+{
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  network_interrupt_arg_t *packet = NULL;
+  while((packet = port_dequeue(port)) != NULL) {
+    datagram_release(packet);
+  }
+  set_interrupt_level(old_level);
+
+  int result = queue_free(port->unbound_t.data);
+  assert(result == 0);
+  semaphore_destroy(port->unbound_t.data_ready);
+  slab_free(miniport_cache, port);
+}
+
 miniport_t*
 miniport_create_unbound(int port_number)
 {
@@ -85,13 +574,16 @@ miniport_create_unbound(int port_number)
   
   interrupt_level_t old_level = set_interrupt_level(DISABLED);
   
-  //If the port has already been created return a reference to the already created port
-  if (unbound_ports[port_number] != NULL) {
-    return unbound_ports[port_number];
+  //If the port has already been created return a reference to the already created port,
+  //unless it is a port group, which has no queue to receive from
+  miniport_t *existing = unbound_ports[port_number];
+  if (existing != NULL) {
+    set_interrupt_level(old_level);
+    return existing->unbound_t.members ? NULL : existing;
   }
   
   //Allocate a new port and set the corresponding reference in the unbound_ports array
-  miniport_t *newport = (miniport_t *) malloc(sizeof(miniport_t));
+  miniport_t *newport = (miniport_t *) slab_alloc(miniport_cache);
   if (!newport) {
     set_interrupt_level(old_level);
     return NULL;
@@ -99,16 +591,73 @@ miniport_create_unbound(int port_number)
   unbound_ports[port_number] = newport;
   set_interrupt_level(old_level);
     
-  // Set the type to unbounded, initialize the data queue, and the waiting semaphore to 0
-  newport->p_type = 'u';
-  newport->p_number = port_number;
-  newport->unbound_t.data = queue_new();
-  newport->unbound_t.data_ready = semaphore_create();
-  semaphore_initialize(newport->unbound_t.data_ready, 0);
+  miniport_init_unbound(newport, port_number);
   
   return newport;
 }
 
+miniport_t*
+miniport_create_group(int port_number, int members, int policy)
+{
+  if(port_number > MAX_UNBOUND_PORT || port_number < MIN_UNBOUND_PORT || members < 1
+     || (policy != MINIPORT_GROUP_ROUND_ROBIN && policy != MINIPORT_GROUP_SOURCE_HASH))
+  {
+    return NULL;
+  }
+
+  miniport_t *group = (miniport_t *) slab_alloc(miniport_cache);
+  miniport_t **member_ports = (miniport_t **) malloc(members * sizeof(miniport_t *));
+  if (!group || !member_ports) {
+    if (group)
+      slab_free(miniport_cache, group);
+    free(member_ports);
+    return NULL;
+  }
+  miniport_init_unbound(group, port_number);
+  for (int i = 0; i < members; i++) {
+    member_ports[i] = (miniport_t *) slab_alloc(miniport_cache);
+    if (!member_ports[i]) {
+      while (i-- > 0)
+        miniport_free_unbound(member_ports[i]);
+      free(member_ports);
+      miniport_free_unbound(group);
+      return NULL;
+    }
+    miniport_init_unbound(member_ports[i], port_number);
+    member_ports[i]->unbound_t.group = group;
+  }
+  group->unbound_t.members = member_ports;
+  group->unbound_t.member_count = members;
+  group->unbound_t.group_policy = policy;
+
+  //The group only becomes reachable once it is complete, and only if the number is free
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int taken = (unbound_ports[port_number] != NULL);
+  if (!taken)
+    unbound_ports[port_number] = group;
+  set_interrupt_level(old_level);
+
+  if (taken) {
+    for (int i = 0; i < members; i++)
+      miniport_free_unbound(member_ports[i]);
+    free(member_ports);
+    miniport_free_unbound(group);
+    return NULL;
+  }
+  return group;
+}
+
+miniport_t*
+miniport_group_member(miniport_t* group, int index)
+{
+  if (!group || group->p_type != 'u' || !group->unbound_t.members
+      || index < 0 || index >= group->unbound_t.member_count)
+  {
+    return NULL;
+  }
+  return group->unbound_t.members[index];
+}
+
 miniport_t*
 miniport_create_bound(network_address_t addr, int remote_unbound_port_number)
 {
@@ -118,7 +667,7 @@ miniport_create_bound(network_address_t addr, int remote_unbound_port_number)
     return NULL;
   }
   
-  miniport_t *newport = (miniport_t *) malloc(sizeof(miniport_t));
+  miniport_t *newport = (miniport_t *) slab_alloc(miniport_cache);
 
   if (!newport) {
     return NULL;
@@ -126,73 +675,202 @@ miniport_create_bound(network_address_t addr, int remote_unbound_port_number)
   
   newport->p_type = 'b'; 
   
-  //Set initial port number value to -1 to check whether a free port was found or not
-  newport->p_number = -1;
-
-  //P the mutex semaphore to perform operations on the bound port queue
-  semaphore_P(mutex);
-
-  // If we have not reached the end of the port space, set ports_free[nPorts] to 0, assign
-  // new port number and increment nPorts
-  if (nPorts < MAX_PORTS - 1) {
-    bound_ports_free[nPorts] = N_FALSE;
-    newport->p_number = nPorts + MIN_BOUND_PORT;
-    nPorts++;
-  }
-  // We have reached the end of the port space. Search for the first free port number
-  else {
-    for (int i = 0; i < MAX_PORTS; i++) {
-      // If port found, set ports_free[i] to 0 and assign the port
-      if (bound_ports_free[i] == N_TRUE) {
-        bound_ports_free[i] = N_FALSE;
-        newport->p_number = i + MIN_BOUND_PORT;
-      }
-    }
-  }
-
-  //V the mutex
-  semaphore_V(mutex);
+  newport->p_number = port_allocator_get(bound_ports);
 
   // Check whether a free port number was found or not
   if (newport->p_number == -1) {
+    slab_free(miniport_cache, newport);
     return NULL;
   }
 
   network_address_copy(addr, newport->bound_t.remote_addr);	
   newport->bound_t.remote_unbound_port = remote_unbound_port_number;
+  newport->bound_t.refcount = 1;
+  newport->bound_t.cached = N_FALSE;
+
+  //Pack the header once; the source port is filled in by each send
+  mini_header_t *header = &newport->bound_t.header;
+  header->protocol = PROTOCOL_MINIDATAGRAM + '0';
+  pack_address(header->source_address, local_host);
+  pack_unsigned_short(header->source_port, 0);
+  pack_address(header->destination_address, addr);
+  pack_unsigned_short(header->destination_port, (unsigned short) remote_unbound_port_number);
   
   return newport;
 }
 
+int
+miniport_join_group(miniport_t* port, unsigned int id)
+{
+  if (!port || port->p_type != 'u' || unbound_ports[port->p_number] != port) {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  group_membership_t *m = port->unbound_t.memberships;
+  while (m && m->id != id)
+    m = m->port_next;
+  if (!m && (m = (group_membership_t *) malloc(sizeof(group_membership_t)))) {
+    m->id = id;
+    m->port = port;
+    m->group_next = group_buckets[id % GROUP_BUCKETS];
+    group_buckets[id % GROUP_BUCKETS] = m;
+    m->port_next = port->unbound_t.memberships;
+    port->unbound_t.memberships = m;
+  }
+  set_interrupt_level(old_level);
+
+  return m ? 0 : -1;
+}
+
+int
+miniport_leave_group(miniport_t* port, unsigned int id)
+{
+  if (!port || port->p_type != 'u') {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  group_membership_t **link = &port->unbound_t.memberships;
+  while (*link && (*link)->id != id)
+    link = &(*link)->port_next;
+  group_membership_t *m = *link;
+  if (m) {
+    *link = m->port_next;
+    link = &group_buckets[id % GROUP_BUCKETS];
+    while (*link != m)
+      link = &(*link)->group_next;
+    *link = m->group_next;
+  }
+  set_interrupt_level(old_level);
+
+  if (!m) {
+    return -1;
+  }
+  free(m);
+  return 0;
+}
+
+minimsg_group_t*
+minimsg_group_create(unsigned int id)
+{
+  minimsg_group_t *group = (minimsg_group_t *) malloc(sizeof(minimsg_group_t));
+  if (!group) {
+    return NULL;
+  }
+  group->id = id;
+  group->hosts = NULL;
+  group->host_count = 0;
+  group->host_capacity = 0;
+
+  //Receivers go by the group id, not by the destination
+  memset(&group->header, 0, sizeof(mini_header_group_t));
+  group->header.protocol = PROTOCOL_MINIGROUP + '0';
+  pack_address(group->header.source_address, local_host);
+  pack_unsigned_int(group->header.group_id, id);
+  return group;
+}
+
+int
+minimsg_group_add_host(minimsg_group_t* group, network_address_t addr)
+{
+  if (!group || !addr) {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int result = 0;
+  if (group->host_count == group->host_capacity) {
+    int capacity = group->host_capacity ? 2 * group->host_capacity : 8;
+    network_address_t *hosts = (network_address_t *) realloc(group->hosts, capacity * sizeof(network_address_t));
+    if (hosts) {
+      group->hosts = hosts;
+      group->host_capacity = capacity;
+    }
+    else {
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    network_address_copy(addr, group->hosts[group->host_count++]);
+  }
+  set_interrupt_level(old_level);
+
+  return result;
+}
+
+int
+minimsg_group_remove_host(minimsg_group_t* group, network_address_t addr)
+{
+  if (!group || !addr) {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int result = -1;
+  for (int i = 0; i < group->host_count; i++) {
+    if (network_compare_network_addresses(group->hosts[i], addr)) {
+      network_address_copy(group->hosts[--group->host_count], group->hosts[i]);
+      result = 0;
+      break;
+    }
+  }
+  set_interrupt_level(old_level);
+
+  return result;
+}
+
+void
+minimsg_group_destroy(minimsg_group_t* group)
+{
+  if (!group) {
+    return;
+  }
+  free(group->hosts);
+  free(group);
+}
+
 void
 miniport_destroy(miniport_t* miniport)
 {
   assert(miniport);
   
+  //A member of a port group goes with its group, and not before
+  if (miniport->p_type == 'u' && miniport->unbound_t.group) {
+    return;
+  }
+
   // If unbounded, then free the data queue and the data_ready semaphore
   if (miniport->p_type == 'u') {
-    //Empty the data queue of the miniport before destroying the queue.
+    //Take the port off the network, then empty its data queue before destroying the queue.
     interrupt_level_t old_level = set_interrupt_level(DISABLED);
     unbound_ports[miniport->p_number] = NULL;
+    while (miniport->unbound_t.memberships) {
+      miniport_leave_group(miniport, miniport->unbound_t.memberships->id);
+    }
+    while (miniport->unbound_t.reassembly) {
+      reassembly_t *r = miniport->unbound_t.reassembly;
+      reassembly_unlink(r);
+      free(r);
+    }
     set_interrupt_level(old_level);
 
-    void **item = NULL;
-    while(queue_dequeue(miniport->unbound_t.data, item) != -1);
-
-    int result = queue_free(miniport->unbound_t.data);
-    assert(result == 0);
-    semaphore_destroy(miniport->unbound_t.data_ready);
-    
+    //The members of a group go with it
+    for (int i = 0; i < miniport->unbound_t.member_count; i++) {
+      miniport_free_unbound(miniport->unbound_t.members[i]);
+    }
+    free(miniport->unbound_t.members);
+    miniport_free_unbound(miniport);
   }
-  // If bounded, then free the remote_addr pointer
+  // If bounded, drop the reference; a port in the reply cache stays there
   else {
-    //free(miniport->bound_t.remote_addr);
-    semaphore_P(mutex);
-    bound_ports_free[miniport->p_number - MIN_BOUND_PORT] = N_TRUE;
-    semaphore_V(mutex);
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    int unused = (--miniport->bound_t.refcount == 0 && !miniport->bound_t.cached);
+    set_interrupt_level(old_level);
+    if (unused) {
+      miniport_free_bound(miniport);
+    }
   }
-  // Free miniport
-  free(miniport);
 }
 
 /*
@@ -206,6 +884,44 @@ miniport_destroy(miniport_t* miniport)
  *
  */
 
+/*
+ * Send a large message as fragments of MINIMSG_FRAGMENT_SIZE bytes, each
+ * with its own header, in as few system calls as the network layer can.
+ */
+static int minimsg_send_fragments(miniport_t* local_unbound_port, miniport_t* local_bound_port,
+                                  minimsg_t* msg, int len)
+{
+  int count = (len + MINIMSG_FRAGMENT_SIZE - 1) / MINIMSG_FRAGMENT_SIZE;
+  mini_header_fragment_t *headers = (mini_header_fragment_t *) malloc(count * sizeof(mini_header_fragment_t));
+  if (!headers) {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  unsigned int message_id = next_message_id++;
+  set_interrupt_level(old_level);
+
+  //Every fragment header starts as the bound port's datagram header
+  for (int i = 0; i < count; i++) {
+    memcpy(&headers[i], &local_bound_port->bound_t.header, sizeof(mini_header_t));
+    headers[i].protocol = PROTOCOL_MINIFRAGMENT + '0';
+    pack_unsigned_short(headers[i].source_port, (unsigned short) local_unbound_port->p_number);
+    pack_unsigned_int(headers[i].message_id, message_id);
+    pack_unsigned_short(headers[i].fragment_index, i);
+    pack_unsigned_short(headers[i].fragment_count, count);
+    pack_unsigned_int(headers[i].message_length, len);
+  }
+
+  int result = network_send_segments(local_bound_port->bound_t.remote_addr, sizeof(mini_header_fragment_t),
+                                     (char *) headers, MINIMSG_FRAGMENT_SIZE, len, msg);
+  free(headers);
+
+  if (result != len + count * (int) sizeof(mini_header_fragment_t)) {
+    return -1;
+  }
+  return len;
+}
+
 int
 minimsg_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minimsg_t* msg, int len)
 {
@@ -214,32 +930,18 @@ minimsg_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minim
     return 0;
   }
     
-  if (len < 0 || len > MINIMSG_MAX_MSG_SIZE) 
+  if (len < 0 || len > MINIMSG_MAX_LARGE_MSG_SIZE) 
     return -1;
-  
-  mini_header_t *header = (mini_header_t *) malloc(sizeof(mini_header_t));
-
-  // Set the Protocol at appropriate position
-  header->protocol = PROTOCOL_MINIDATAGRAM + '0';
 
-  //Get the local source address
-  network_address_t local_addr = {0, 0};
-  network_get_my_address(local_addr);
-  
-  //Pack the local address' into the appropriate position
-  pack_address(header->source_address, local_addr);
-
-  //Pack the local unbound port's address that will be used by the receiver for sending back data
-  pack_unsigned_short(header->source_port, (unsigned short) local_unbound_port->p_number);
-  
-  //Pack the remote address into the appropriate position
-  pack_address(header->destination_address, local_bound_port->bound_t.remote_addr);
+  if (len > MINIMSG_MAX_MSG_SIZE)
+    return minimsg_send_fragments(local_unbound_port, local_bound_port, msg, len);
   
-  //Pack the remote unbound port number into the appropriate position
-  pack_unsigned_short(header->destination_port, (unsigned short) local_bound_port->bound_t.remote_unbound_port);
+  //Copy the bound port's header and put in the unbound port that the receiver will reply to
+  mini_header_t header = local_bound_port->bound_t.header;
+  pack_unsigned_short(header.source_port, (unsigned short) local_unbound_port->p_number);
 
   //Send the datagram over the network
-  int result = network_send_pkt(local_bound_port->bound_t.remote_addr, sizeof(mini_header_t), (char *) header, len, (char *) msg);
+  int result = network_send_pkt(local_bound_port->bound_t.remote_addr, sizeof(mini_header_t), (char *) &header, len, (char *) msg);
 
   if (result == -1) { 
     return result;
@@ -248,6 +950,40 @@ minimsg_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minim
   return (result - sizeof(mini_header_t));
 }
 
+/*
+ * The bound port for replies to a sender: the cached one if the sender was
+ * seen recently, otherwise a new one, which goes into the cache.
+ */
+static miniport_t *minimsg_reply_port(network_address_t addr, int port_number)
+{
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  miniport_t *port = reply_cache_lookup(addr, port_number);
+  set_interrupt_level(old_level);
+  if (port) {
+    return port;
+  }
+
+  port = miniport_create_bound(addr, port_number);
+  if (!port) {
+    return NULL;
+  }
+
+  //Another thread may have cached a port for the same sender meanwhile
+  old_level = set_interrupt_level(DISABLED);
+  miniport_t *cached = reply_cache_lookup(addr, port_number);
+  miniport_t *victim = cached ? NULL : reply_cache_insert(port);
+  set_interrupt_level(old_level);
+
+  if (cached) {
+    miniport_destroy(port);
+    return cached;
+  }
+  if (victim) {
+    miniport_free_bound(victim);
+  }
+  return port;
+}
+
 int
 minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_port, minimsg_t* msg, int *len)
 {
@@ -260,9 +996,9 @@ minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_por
   semaphore_P(local_unbound_port->unbound_t.data_ready);
 
   //Get the first argument from the data queue
-  network_interrupt_arg_t *arg = NULL;
-
-  queue_dequeue(local_unbound_port->unbound_t.data, (void **) &arg);  
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  network_interrupt_arg_t *arg = port_dequeue(local_unbound_port);
+  set_interrupt_level(old_level);
   assert(arg);
   
   //Get the message and message length from the argument
@@ -275,7 +1011,7 @@ minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_por
   if (message_length == 0) {
     msg = NULL;
     len = 0;
-    free(arg);
+    datagram_release(arg);
     return 0;
   }
 
@@ -284,8 +1020,8 @@ minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_por
   unpack_address(header->source_address, source_address);
   int source_port_number = unpack_unsigned_short(header->source_port);
 
-  //Create a new local bound port for replying back to the sender
-  *new_local_bound_port = miniport_create_bound(source_address, source_port_number);
+  //Find or create the local bound port for replying back to the sender
+  *new_local_bound_port = minimsg_reply_port(source_address, source_port_number);
   
   //Pass the message back to the msg parameter passed in the function.
   //NOTE - A security leak could be caused if just do - msg = message[i + sizeof(header)]
@@ -298,17 +1034,321 @@ minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_por
   //Write the length of the message to the len parameter of the function
   *len = message_length;
   //Free the data packet before returning to the caller
-  free(arg);
+  datagram_release(arg);
 
   //Return the size of the payload - header
   return message_length;
 }
 
+int
+minimsg_receive_zc(miniport_t* local_unbound_port, miniport_t** new_local_bound_port, minimsg_view_t* view)
+{
+  if(!local_unbound_port || !new_local_bound_port || !view)
+  {
+    return 0;
+  }
+
+  //Wait for a datagram and take it off the data queue, as minimsg_receive does
+  semaphore_P(local_unbound_port->unbound_t.data_ready);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  network_interrupt_arg_t *arg = port_dequeue(local_unbound_port);
+  set_interrupt_level(old_level);
+  assert(arg);
+
+  mini_header_t *header = (mini_header_t *) arg->buffer;
+  int message_length = arg->size - sizeof(mini_header_t);
+  unpack_address(header->source_address, view->sender);
+  view->source_port = unpack_unsigned_short(header->source_port);
+  if (message_length == 0) {
+    view->msg = NULL;
+    view->len = 0;
+    view->packet = NULL;
+    *new_local_bound_port = NULL;
+    datagram_release(arg);
+    return 0;
+  }
+
+  *new_local_bound_port = minimsg_reply_port(view->sender, view->source_port);
+
+  //Lend the payload where it lies; the packet stays with the caller until minimsg_release
+  view->msg = arg->buffer + sizeof(mini_header_t);
+  view->len = message_length;
+  view->packet = arg;
+  return message_length;
+}
+
+void
+minimsg_release(minimsg_view_t* view)
+{
+  if (!view || !view->packet) {
+    return;
+  }
+  datagram_release((network_interrupt_arg_t *) view->packet);
+  view->msg = NULL;
+  view->len = 0;
+  view->packet = NULL;
+}
+
+int
+minimsg_send_many(miniport_t* local_unbound_port, miniport_t** local_bound_ports, minimsg_t** msgs, int* lens, int n)
+{
+  if(!local_unbound_port || !local_bound_ports || !msgs || !lens || n < 0 || !send_batch)
+  {
+    return -1;
+  }
+
+  int sent = 0;
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  for (int i = 0; i < n; i++) {
+    if (!local_bound_ports[i] || !msgs[i] || lens[i] < 0 || lens[i] > MINIMSG_MAX_MSG_SIZE) {
+      break;
+    }
+    mini_header_t header = local_bound_ports[i]->bound_t.header;
+    pack_unsigned_short(header.source_port, (unsigned short) local_unbound_port->p_number);
+    //The batch copies the header, and sends by itself whenever it fills up
+    if (network_batch_add(send_batch, local_bound_ports[i]->bound_t.remote_addr,
+                          sizeof(mini_header_t), (char *) &header, lens[i], msgs[i]) == -1) {
+      break;
+    }
+    sent++;
+  }
+  if (network_batch_length(send_batch) > 0 && network_send_batch(send_batch) == -1) {
+    sent = 0;
+  }
+  set_interrupt_level(old_level);
+
+  return (sent == 0 && n > 0) ? -1 : sent;
+}
+
+int
+minimsg_send_group(miniport_t* local_unbound_port, minimsg_group_t* group, minimsg_t* msg, int len)
+{
+  if(!local_unbound_port || !group || !msg || len < 0 || len > MINIMSG_MAX_MSG_SIZE || !send_batch)
+  {
+    return -1;
+  }
+
+  mini_header_group_t header = group->header;
+  pack_unsigned_short(header.source_port, (unsigned short) local_unbound_port->p_number);
+
+  if (network_bcast_enabled()) {
+    return (network_bcast_pkt(sizeof(mini_header_group_t), (char *) &header, len, msg) == -1) ? -1 : len;
+  }
+
+  //One copy for each host, all of them in one batch
+  int result = len;
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  for (int i = 0; i < group->host_count; i++) {
+    if (network_batch_add(send_batch, group->hosts[i], sizeof(mini_header_group_t), (char *) &header,
+                          len, msg) == -1) {
+      result = -1;
+    }
+  }
+  if (network_batch_length(send_batch) > 0 && network_send_batch(send_batch) == -1) {
+    result = -1;
+  }
+  set_interrupt_level(old_level);
+
+  return result;
+}
+
+int
+minimsg_receive_many(miniport_t* local_unbound_port, miniport_t** new_local_bound_ports, minimsg_view_t* views, int n)
+{
+  if(!local_unbound_port || !views || n <= 0)
+  {
+    return 0;
+  }
+
+  //One semaphore operation for everything that is ready, then one critical section to dequeue it
+  int count = semaphore_P_many(local_unbound_port->unbound_t.data_ready, n);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  for (int i = 0; i < count; i++) {
+    network_interrupt_arg_t *arg = port_dequeue(local_unbound_port);
+    assert(arg);
+    views[i].msg = arg->buffer + sizeof(mini_header_t);
+    views[i].len = arg->size - sizeof(mini_header_t);
+    views[i].packet = arg;
+  }
+  set_interrupt_level(old_level);
+
+  for (int i = 0; i < count; i++) {
+    mini_header_t *header = (mini_header_t *) ((network_interrupt_arg_t *) views[i].packet)->buffer;
+    unpack_address(header->source_address, views[i].sender);
+    views[i].source_port = unpack_unsigned_short(header->source_port);
+  }
+
+  //Reply ports are only looked up for callers that want them
+  for (int i = 0; new_local_bound_ports && i < count; i++) {
+    new_local_bound_ports[i] = minimsg_reply_port(views[i].sender, views[i].source_port);
+  }
+
+  return count;
+}
+
+/*
+ * A fragment of a large message has arrived: copy it into place, and queue
+ * the message on its port once all of its fragments are in. Called from
+ * the network handler, with interrupts disabled.
+ */
+static void handle_fragment(network_interrupt_arg_t *arg)
+{
+  if (arg->size <= sizeof(mini_header_fragment_t) || arg->size > MAX_NETWORK_PKT_SIZE) {
+    network_packet_release(arg);
+    return;
+  }
+
+  mini_header_fragment_t *header = (mini_header_fragment_t *) arg->buffer;
+  int port_number = unpack_unsigned_short(header->destination_port);
+  miniport_t *port = (port_number <= MAX_UNBOUND_PORT) ? unbound_ports[port_number] : NULL;
+  int index = unpack_unsigned_short(header->fragment_index);
+  int count = unpack_unsigned_short(header->fragment_count);
+  int length = unpack_unsigned_int(header->message_length);
+  int fragment_length = arg->size - sizeof(mini_header_fragment_t);
+
+  //The fragment must be where the sender's fragmentation would have put it
+  if (!port || length <= 0 || length > MINIMSG_MAX_LARGE_MSG_SIZE
+      || count != (length + MINIMSG_FRAGMENT_SIZE - 1) / MINIMSG_FRAGMENT_SIZE || index >= count
+      || fragment_length != ((index == count - 1) ? length - index * MINIMSG_FRAGMENT_SIZE : MINIMSG_FRAGMENT_SIZE)) {
+    network_packet_release(arg);
+    return;
+  }
+
+  uint64_t now = currentTimeMillis();
+  reassembly_expire(now);
+
+  network_address_t source_address;
+  unpack_address(header->source_address, source_address);
+  int source_port = unpack_unsigned_short(header->source_port);
+  unsigned int message_id = unpack_unsigned_int(header->message_id);
+
+  reassembly_t *r = port->unbound_t.reassembly;
+  while (r && !(r->message_id == message_id && r->source_port == source_port
+                && network_compare_network_addresses(r->source_address, source_address))) {
+    r = r->port_next;
+  }
+
+  if (!r) {
+    int size = sizeof(reassembly_t) + sizeof(mini_header_t) + length;
+    if (reassembly_bytes + size > MINIMSG_REASSEMBLY_MEMORY || !(r = (reassembly_t *) malloc(size))) {
+      network_packet_release(arg);
+      return;
+    }
+    network_address_copy(source_address, r->source_address);
+    r->source_port = source_port;
+    r->message_id = message_id;
+    r->count = count;
+    r->received = 0;
+    r->length = length;
+    r->deadline = now + MINIMSG_REASSEMBLY_TIMEOUT;
+    memset(r->have, 0, sizeof(r->have));
+    memcpy(r->buffer, header, sizeof(mini_header_t));
+    r->port = port;
+    r->port_next = port->unbound_t.reassembly;
+    port->unbound_t.reassembly = r;
+    r->age_next = NULL;
+    r->age_prev = age_tail;
+    if (age_tail)
+      age_tail->age_next = r;
+    else
+      age_head = r;
+    age_tail = r;
+    reassembly_bytes += size;
+    reassembly_expire(now);
+  }
+
+  //Duplicates and fragments that disagree with the first one are dropped
+  if (r->count != count || r->length != length || (r->have[index / 8] & (1 << (index % 8)))) {
+    network_packet_release(arg);
+    return;
+  }
+  memcpy(r->buffer + sizeof(mini_header_t) + index * MINIMSG_FRAGMENT_SIZE,
+         arg->buffer + sizeof(mini_header_fragment_t), fragment_length);
+  r->have[index / 8] |= 1 << (index % 8);
+  r->received++;
+  network_packet_release(arg);
+
+  if (r->received == r->count) {
+    reassembly_unlink(r);
+    network_address_copy(source_address, r->arg.sender);
+    r->arg.buffer = r->buffer;
+    r->arg.size = sizeof(mini_header_t) + length;
+    port_deliver(port, &r->arg);
+  }
+}
+
+/*
+ * A datagram sent to a multicast group has arrived: deliver it, as a plain
+ * datagram, to every local port that has joined the group. The ports share
+ * the packet, with a reference each. Called from the network handler, with
+ * interrupts disabled.
+ */
+static void handle_group(network_interrupt_arg_t *arg)
+{
+  if (arg->size <= sizeof(mini_header_group_t) || arg->size > MAX_NETWORK_PKT_SIZE) {
+    network_packet_release(arg);
+    return;
+  }
+
+  mini_header_group_t *header = (mini_header_group_t *) arg->buffer;
+  unsigned int id = unpack_unsigned_int(header->group_id);
+  group_membership_t *m;
+  int count = 0;
+  for (m = group_buckets[id % GROUP_BUCKETS]; m; m = m->group_next) {
+    if (m->id == id)
+      count++;
+  }
+  if (count == 0) {
+    network_packet_release(arg);
+    return;
+  }
+
+  //Put a plain datagram header right before the payload
+  int extra = sizeof(mini_header_group_t) - sizeof(mini_header_t);
+  memmove(arg->buffer + extra, arg->buffer, sizeof(mini_header_t));
+  arg->buffer += extra;
+  arg->size -= extra;
+  arg->buffer[0] = PROTOCOL_MINIDATAGRAM + '0';
+
+  for (m = group_buckets[id % GROUP_BUCKETS]; m; m = m->group_next) {
+    if (m->id == id) {
+      if (--count > 0)
+        network_packet_hold(arg);
+      port_deliver(m->port, arg);
+    }
+  }
+}
+
+int minimsg_deliver_reliable(network_interrupt_arg_t *arg)
+{
+  mini_header_t *header = (mini_header_t *) arg->buffer;
+  int port = unpack_unsigned_short(header->destination_port);
+
+  if (port > MAX_UNBOUND_PORT || unbound_ports[port] == NULL) {
+    network_packet_release(arg);
+    return -1;
+  }
+
+  //Marked so that drop-head leaves it alone once it is queued
+  arg->buffer[0] = PROTOCOL_MINIRDP + '0';
+  return port_deliver(unbound_ports[port], arg);
+}
+
 void handle_udp_packet(network_interrupt_arg_t *arg)
 {
+  if (arg->buffer[0] == PROTOCOL_MINIFRAGMENT + '0') {
+    handle_fragment(arg);
+    return;
+  }
+
+  if (arg->buffer[0] == PROTOCOL_MINIGROUP + '0') {
+    handle_group(arg);
+    return;
+  }
+
   if(arg->size <= sizeof(mini_header_t) || arg->size > MAX_NETWORK_PKT_SIZE)
   {
-    free(arg);
+    network_packet_release(arg);
     return;
   }
 
@@ -316,11 +1356,10 @@ void handle_udp_packet(network_interrupt_arg_t *arg)
   int port = unpack_unsigned_short(header->destination_port);
   
   if (unbound_ports[port] == NULL) {
-    free(arg);
+    network_packet_release(arg);
     return;
   }
 
-  queue_append(minimsg_get_data_queue(port), arg);
-  semaphore_V(minimsg_get_semaphore(port));
+  port_deliver(unbound_ports[port], arg);
   return;
 }
@@ -17,6 +17,17 @@
  * Must be <= MAX_NETWORK_PKT_SIZE - NETWORK_HDR_SIZE
  */
 #define MINIMSG_MAX_MSG_SIZE (4096)
+
+/* Larger messages, up to MINIMSG_MAX_LARGE_MSG_SIZE, are sent as fragments of
+ * MINIMSG_FRAGMENT_SIZE bytes and put back together by the receiver. Partial
+ * messages are given up after MINIMSG_REASSEMBLY_TIMEOUT milliseconds, and take
+ * at most MINIMSG_REASSEMBLY_MEMORY bytes altogether; fragments of new messages
+ * beyond that are dropped.
+ */
+#define MINIMSG_MAX_LARGE_MSG_SIZE (1 << 20)
+#define MINIMSG_FRAGMENT_SIZE (MAX_NETWORK_PKT_SIZE - (int) sizeof(mini_header_fragment_t))
+#define MINIMSG_REASSEMBLY_TIMEOUT 2000
+#define MINIMSG_REASSEMBLY_MEMORY (16 << 20)
 #define MAX_PORTS 32768
 #define MAX_UNBOUND_PORT 32767
 #define MIN_UNBOUND_PORT 0
@@ -26,6 +37,24 @@
 typedef struct miniport miniport_t;
 typedef char minimsg_t;
 
+/* What happens to a datagram that arrives at an unbound port whose queue is full:
+ * it is dropped (drop-tail), or the oldest datagrams are dropped to make room for
+ * it (drop-head).
+ */
+enum { MINIPORT_DROP_TAIL = 1, MINIPORT_DROP_HEAD };
+
+/* Datagrams of all unbound ports together may take no more than this many bytes
+ * while they wait to be received; above it, arriving datagrams are dropped.
+ */
+#define MINIMSG_DEFAULT_MEMORY_BUDGET (64 << 20)
+
+typedef struct {
+  int queued_packets;
+  int queued_bytes;
+  long long int dropped_packets;
+  long long int dropped_bytes;
+} miniport_queue_stats_t;
+
 queue_t* minimsg_get_data_queue(int arg);
 semaphore_t* minimsg_get_semaphore(int arg);
 
@@ -38,7 +67,8 @@ void minimsg_initialize();
  * of the programmer to make sure he does not destroy unbound miniports while they
  * are still in use by other threads -- this would result in undefined behavior.
  * Unbound ports must range from 0 to 32767. If the programmer specifies a port number
- * outside this range, it is considered an error.
+ * outside this range, it is considered an error. Returns NULL for the number of a port
+ * group, whose datagrams are only received through its members.
  */
 miniport_t* miniport_create_unbound(int port_number);
 
@@ -52,11 +82,53 @@ miniport_t* miniport_create_unbound(int port_number);
  */
 miniport_t* miniport_create_bound(network_address_t addr, int remote_unbound_port_number);
 
+/* How a port group spreads the datagrams that arrive at its port number over its
+ * members: each to the next member in turn, or each to the member that the
+ * sender's address and port hash to, which keeps every sender's datagrams in order.
+ */
+enum { MINIPORT_GROUP_ROUND_ROBIN = 1, MINIPORT_GROUP_SOURCE_HASH };
+
+/* Creates an unbound port whose datagrams are shared out among the queues of its
+ * members, one for each worker thread that is to receive from the port. The group port is
+ * the one to send with and to destroy, which destroys the members too; workers receive
+ * on the members, each an unbound port of the same number, with any of the receive
+ * functions, and may set their queue limits, but not destroy them: destroying a member
+ * does nothing. Returns NULL if the port number is already in use, or on invalid
+ * arguments.
+ */
+miniport_t* miniport_create_group(int port_number, int members, int policy);
+
+/* Returns member index (from 0) of a port group, or NULL if there is no such member. */
+miniport_t* miniport_group_member(miniport_t* group, int index);
+
 /* Destroys a miniport and frees up its resources. If the miniport was in use at
  * the time it was destroyed, subsequent behavior is undefined.
  */
 void miniport_destroy(miniport_t* miniport);
 
+/* Returns the number of a port. */
+int miniport_get_number(miniport_t* port);
+
+/* Copies the remote address of a bound port into addr and returns its remote unbound
+ * port number, or returns -1 if the port is not bound.
+ */
+int miniport_get_remote(miniport_t* port, network_address_t addr);
+
+/* Limits the queue of datagrams waiting on an unbound port to max_packets datagrams and
+ * max_bytes bytes (0 for no limit, the default), with the given MINIPORT_DROP_* policy.
+ * For a port group, sets the same limits on the queue of each of its members.
+ * Returns 0 on success, -1 on invalid arguments.
+ */
+int miniport_set_queue_limits(miniport_t* port, int max_packets, int max_bytes, int policy);
+
+/* Fills in how much is waiting on an unbound port and how much it has dropped; for a
+ * port group, the totals over its members. Returns 0 on success, -1 on invalid arguments.
+ */
+int miniport_get_queue_stats(miniport_t* port, miniport_queue_stats_t* stats);
+
+/* Sets the budget of all unbound ports together (0 restores the default). */
+void minimsg_set_memory_budget(int bytes);
+
 /* Sends a message through a locally bound port (the bound port already has an associated
  * receiver address so it is sufficient to just supply the bound port number). In order
  * for the remote system to correctly create a bound port for replies back to the sending
@@ -64,7 +136,8 @@ void miniport_destroy(miniport_t* miniport);
  * The msg parameter is a pointer to a data payload that the user wishes to send and does not
  * include a network header; your implementation of minimsg_send must construct the header
  * before calling network_send_pkt(). The return value of this function is the number of
- * data payload bytes sent not inclusive of the header.
+ * data payload bytes sent not inclusive of the header. Messages longer than
+ * MINIMSG_MAX_MSG_SIZE are fragmented; if any fragment is lost, so is the whole message.
  */
 int minimsg_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minimsg_t* msg, int len);
 
@@ -75,7 +148,99 @@ int minimsg_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, m
  * responsibility of this function to strip off and parse the header before returning the
  * data payload and data length via the respective msg and len parameter. The return value
  * of this function is the number of data payload bytes received not inclusive of the header.
+ *
+ * The bound ports created here are cached for the 256 most recent senders, so that a
+ * sender that is heard from again gets the same bound port back. Every port returned
+ * must still be destroyed once by the caller; a cached port is only freed after it has
+ * left the cache and all of its references are destroyed.
  */
 int minimsg_receive(miniport_t* local_unbound_port, miniport_t** new_local_bound_port, minimsg_t* msg, int *len);
+
+/* A received datagram lent to the caller by minimsg_receive_zc: msg points at the
+ * len bytes of the payload inside the network packet, and must not be written to.
+ * sender and source_port are the address and port number that the datagram was sent
+ * from. packet belongs to the minimsg layer.
+ */
+typedef struct {
+  const minimsg_t *msg;
+  int len;
+  network_address_t sender;
+  int source_port;
+  void *packet;
+} minimsg_view_t;
+
+/* Like minimsg_receive, but instead of copying the payload out, fills in view so that
+ * it points into the received packet. The packet is held until the view is handed back
+ * with minimsg_release, which must be done exactly once; holding many views ties up the
+ * network layer's packet buffers. new_local_bound_port is set as by minimsg_receive.
+ * Returns the payload length.
+ */
+int minimsg_receive_zc(miniport_t* local_unbound_port, miniport_t** new_local_bound_port, minimsg_view_t* view);
+
+/* Returns the packet behind a view filled in by minimsg_receive_zc. */
+void minimsg_release(minimsg_view_t* view);
+
+/* Sends n messages in one go: message i, of lens[i] bytes, through local_bound_ports[i]
+ * (the same port may appear any number of times), with replies going to
+ * local_unbound_port. The datagrams leave in as few system calls as possible.
+ * Stops at the first invalid message. Returns the number of messages sent, or -1
+ * if none could be.
+ */
+int minimsg_send_many(miniport_t* local_unbound_port, miniport_t** local_bound_ports, minimsg_t** msgs, int* lens, int n);
+
+/* Receives up to n datagrams through an unbound port in one go, blocking only until the
+ * first one arrives, and lends them to the caller as views, like minimsg_receive_zc.
+ * Each of the returned views must be given back with minimsg_release. If
+ * new_local_bound_ports is not NULL, it is filled with the reply port of each sender,
+ * to be destroyed as those of minimsg_receive. Returns the number of datagrams received.
+ */
+int minimsg_receive_many(miniport_t* local_unbound_port, miniport_t** new_local_bound_ports, minimsg_view_t* views, int n);
+
+/* Multicast groups, identified by a number chosen by the application. A datagram sent
+ * to a group is received by every unbound port that has joined the group on each host
+ * it reaches, as if it had been sent to that port with minimsg_send. If the network
+ * layer was built with broadcast support, datagrams to a group are broadcast and every
+ * host keeps those of the groups that its ports have joined; otherwise they go to the
+ * hosts added to the sending handle of the group.
+ */
+typedef struct minimsg_group minimsg_group_t;
+
+/* Makes an unbound port receive the datagrams sent to group id. Returns 0 on success
+ * (also if the port had joined already), -1 on invalid arguments or if out of memory.
+ */
+int miniport_join_group(miniport_t* port, unsigned int id);
+
+/* Stops an unbound port from receiving the datagrams of group id. Destroying the port
+ * leaves all of its groups. Returns 0 on success, -1 if the port had not joined.
+ */
+int miniport_leave_group(miniport_t* port, unsigned int id);
+
+/* Creates a handle for sending to group id, with no hosts. Returns NULL on error. */
+minimsg_group_t* minimsg_group_create(unsigned int id);
+
+/* Adds a host to, or removes one from, those that datagrams to the group are sent to
+ * when they are not broadcast. Returns 0 on success, -1 on invalid arguments, if out
+ * of memory, or if the host is not there to remove.
+ */
+int minimsg_group_add_host(minimsg_group_t* group, network_address_t addr);
+int minimsg_group_remove_host(minimsg_group_t* group, network_address_t addr);
+
+/* Destroys a handle for sending to a group. */
+void minimsg_group_destroy(minimsg_group_t* group);
+
+/* Sends a message of at most MINIMSG_MAX_MSG_SIZE bytes to a group, with replies going
+ * to local_unbound_port. The header is built once for all the copies, which leave in
+ * one broadcast, or in as few system calls as possible. Returns the number of payload
+ * bytes sent, or -1 on error.
+ */
+int minimsg_send_group(miniport_t* local_unbound_port, minimsg_group_t* group, minimsg_t* msg, int len);
+
+/* Queues a datagram that arrived reliably (minirdp.h), with a plain datagram header, on
+ * its port. Once queued, it is never dropped to make room for others, since its sender is
+ * told that it arrived. Returns 0 if it was queued, or -1 if it was dropped, in which
+ * case it must not be acknowledged.
+ */
+int minimsg_deliver_reliable(network_interrupt_arg_t *arg);
+
 void handle_udp_packet(network_interrupt_arg_t *arg);
 #endif /*__MINIMSG_H__*/
@@ -0,0 +1,494 @@
+/*
+ *  Implementation of reliable datagrams.
+ */
+#include "minirdp.h"
+#include "interrupts.h"
+#include "alarm.h"
+#include "synch.h"
+#include "machineprimitives.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define N_TRUE 1
+#define N_FALSE 0
+
+//Size of the flow hash table
+#define FLOW_BUCKETS 256
+
+typedef struct rdp_flow rdp_flow_t;
+
+/*
+ * A datagram waiting to be acknowledged, with its header, of which only the
+ * window base changes from one transmission to the next.
+ */
+typedef struct rdp_message
+{
+  rdp_flow_t *flow;
+  unsigned int seq;
+  int retries;
+  int fast_retransmitted;
+  int timeout;
+  alarm_id timer;
+  int len;
+  mini_header_rdp_t header;
+  char data[];
+} rdp_message_t;
+
+/*
+ * The traffic between a local unbound port and a remote endpoint, in both
+ * directions: the datagrams we have outstanding, by sequence number modulo
+ * the window, and which of the remote end's datagrams we have received.
+ * Flows are in a hash table by their endpoints, and on a list by when they
+ * were last used, most recent first. Protected by disabling interrupts.
+ */
+struct rdp_flow
+{
+  int local_port;
+  network_address_t remote_addr;
+  int remote_port;
+  //Packed once, for both datagrams and acknowledgments
+  mini_header_rdp_t header;
+
+  //Sending: the numbers from send_base up to next_seq are the ones in the window
+  unsigned int send_id;
+  unsigned int next_seq;
+  unsigned int send_base;
+  rdp_message_t *window[MINIRDP_WINDOW];
+  int in_flight;
+  int given_up;
+  //Threads waiting for the window to move, and the semaphore they wait on
+  int waiting;
+  semaphore_t *window_changed;
+
+  //Receiving: everything before recv_base has been received, and bit i of recv_bits
+  //says whether recv_base + i has
+  int receiving;
+  unsigned int recv_id;
+  unsigned int recv_base;
+  uint64_t recv_bits;
+
+  uint64_t last_used;
+  rdp_flow_t *hash_next;
+  rdp_flow_t *lru_prev;
+  rdp_flow_t *lru_next;
+};
+
+//The unbound ports of minimsg, which reliable datagrams are delivered to
+extern miniport_t *unbound_ports[MAX_PORTS];
+
+static rdp_flow_t *flow_buckets[FLOW_BUCKETS];
+static rdp_flow_t *lru_head;
+static rdp_flow_t *lru_tail;
+static network_address_t local_host;
+//Tells a flow from an earlier one between the same endpoints, and from those of an earlier run
+static unsigned int next_flow_id;
+
+void
+minirdp_initialize()
+{
+  network_get_my_address(local_host);
+  for (int i = 0; i < FLOW_BUCKETS; i++)
+    flow_buckets[i] = NULL;
+  lru_head = NULL;
+  lru_tail = NULL;
+  next_flow_id = (unsigned int) currentTimeMillis() * 2654435761u;
+}
+
+static unsigned int flow_hash(int local_port, const network_address_t addr, int remote_port)
+{
+  unsigned int h = addr[0] * 2654435761u;
+  h ^= addr[1] * 40503u;
+  h ^= ((unsigned int) remote_port << 16 | local_port) * 2246822519u;
+  return (h ^ (h >> 15)) % FLOW_BUCKETS;
+}
+
+static void lru_unlink(rdp_flow_t *flow)
+{
+  if (flow->lru_prev)
+    flow->lru_prev->lru_next = flow->lru_next;
+  else
+    lru_head = flow->lru_next;
+  if (flow->lru_next)
+    flow->lru_next->lru_prev = flow->lru_prev;
+  else
+    lru_tail = flow->lru_prev;
+}
+
+static void lru_push_front(rdp_flow_t *flow)
+{
+  flow->lru_prev = NULL;
+  flow->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = flow;
+  else
+    lru_tail = flow;
+  lru_head = flow;
+}
+
+static void flow_touch(rdp_flow_t *flow, uint64_t now)
+{
+  flow->last_used = now;
+  lru_unlink(flow);
+  lru_push_front(flow);
+}
+
+/*
+ * Forget the flows that have been idle for too long. A flow with datagrams
+ * outstanding or threads waiting on it has been used recently, so the
+ * oldest flow is always an idle one if any is. Called with interrupts
+ * disabled.
+ */
+static void flow_expire(uint64_t now)
+{
+  while (lru_tail && lru_tail->last_used + MINIRDP_FLOW_TIMEOUT <= now
+         && lru_tail->in_flight == 0 && lru_tail->waiting == 0) {
+    rdp_flow_t *flow = lru_tail;
+    lru_unlink(flow);
+    rdp_flow_t **link = &flow_buckets[flow_hash(flow->local_port, flow->remote_addr, flow->remote_port)];
+    while (*link != flow)
+      link = &(*link)->hash_next;
+    *link = flow->hash_next;
+    semaphore_destroy(flow->window_changed);
+    free(flow);
+  }
+}
+
+/*
+ * Find the flow between two endpoints, and create it if asked to. Returns
+ * NULL if there is none. Called with interrupts disabled.
+ */
+static rdp_flow_t *flow_find(int local_port, const network_address_t remote_addr, int remote_port, int create)
+{
+  rdp_flow_t **bucket = &flow_buckets[flow_hash(local_port, remote_addr, remote_port)];
+  rdp_flow_t *flow;
+
+  for (flow = *bucket; flow; flow = flow->hash_next) {
+    if (flow->local_port == local_port && flow->remote_port == remote_port
+        && network_compare_network_addresses(flow->remote_addr, remote_addr)) {
+      return flow;
+    }
+  }
+  if (!create || !(flow = (rdp_flow_t *) malloc(sizeof(rdp_flow_t)))) {
+    return NULL;
+  }
+
+  flow->local_port = local_port;
+  network_address_copy(remote_addr, flow->remote_addr);
+  flow->remote_port = remote_port;
+  memset(&flow->header, 0, sizeof(mini_header_rdp_t));
+  flow->header.protocol = PROTOCOL_MINIRDP + '0';
+  pack_address(flow->header.source_address, local_host);
+  pack_unsigned_short(flow->header.source_port, (unsigned short) local_port);
+  pack_address(flow->header.destination_address, remote_addr);
+  pack_unsigned_short(flow->header.destination_port, (unsigned short) remote_port);
+
+  flow->send_id = next_flow_id++;
+  flow->next_seq = 0;
+  flow->send_base = 0;
+  memset(flow->window, 0, sizeof(flow->window));
+  flow->in_flight = 0;
+  flow->given_up = 0;
+  flow->waiting = 0;
+  flow->window_changed = semaphore_create();
+  semaphore_initialize(flow->window_changed, 0);
+  flow->receiving = N_FALSE;
+
+  flow->last_used = 0;
+  flow->hash_next = *bucket;
+  *bucket = flow;
+  lru_push_front(flow);
+  return flow;
+}
+
+/*
+ * Send a datagram, again or for the first time. When the receiver is local,
+ * the acknowledgment may be handled before this returns, and the message
+ * freed. Called with interrupts disabled.
+ */
+static void rdp_transmit(rdp_message_t *message)
+{
+  pack_unsigned_int(message->header.window_base, message->flow->send_base);
+  network_send_pkt(message->flow->remote_addr, sizeof(mini_header_rdp_t), (char *) &message->header,
+                   message->len, message->data);
+}
+
+/*
+ * A datagram has been acknowledged or given up: forget it, move the window
+ * past it if it was the oldest, and let the threads waiting on the window
+ * look again. Its alarm must have gone off or been deregistered. Called
+ * with interrupts disabled.
+ */
+static void rdp_settle(rdp_message_t *message)
+{
+  rdp_flow_t *flow = message->flow;
+
+  flow->window[message->seq % MINIRDP_WINDOW] = NULL;
+  flow->in_flight--;
+  free(message);
+
+  while (flow->send_base != flow->next_seq && !flow->window[flow->send_base % MINIRDP_WINDOW])
+    flow->send_base++;
+  while (flow->waiting > 0) {
+    flow->waiting--;
+    semaphore_V(flow->window_changed);
+  }
+}
+
+//Alarm handler: retransmit a datagram that has not been acknowledged in time, or give up on it
+static void rdp_retransmit(void *arg)
+{
+  rdp_message_t *message = (rdp_message_t *) arg;
+
+  if (message->retries < MINIRDP_MAX_RETRIES) {
+    message->retries++;
+    message->timeout *= 2;
+    message->timer = register_alarm(message->timeout, rdp_retransmit, message);
+    if (message->timer) {
+      flow_touch(message->flow, currentTimeMillis());
+      rdp_transmit(message);
+      return;
+    }
+  }
+  message->flow->given_up++;
+  rdp_settle(message);
+}
+
+int
+minirdp_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minimsg_t* msg, int len)
+{
+  network_address_t remote_addr;
+
+  if (!local_unbound_port || !local_bound_port || !msg || len < 0 || len > MINIRDP_MAX_MSG_SIZE) {
+    return -1;
+  }
+  int remote_port = miniport_get_remote(local_bound_port, remote_addr);
+  if (remote_port == -1) {
+    return -1;
+  }
+
+  //Keep a copy to retransmit
+  rdp_message_t *message = (rdp_message_t *) malloc(sizeof(rdp_message_t) + len);
+  if (!message) {
+    return -1;
+  }
+  memcpy(message->data, msg, len);
+  message->len = len;
+  message->retries = 0;
+  message->fast_retransmitted = N_FALSE;
+  message->timeout = MINIRDP_INITIAL_TIMEOUT;
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  flow_expire(currentTimeMillis());
+  rdp_flow_t *flow = flow_find(miniport_get_number(local_unbound_port), remote_addr, remote_port, N_TRUE);
+  if (!flow) {
+    set_interrupt_level(old_level);
+    free(message);
+    return -1;
+  }
+
+  //Wait for the oldest outstanding datagram to leave the window
+  while (flow->next_seq - flow->send_base >= MINIRDP_WINDOW) {
+    flow->waiting++;
+    set_interrupt_level(old_level);
+    semaphore_P(flow->window_changed);
+    old_level = set_interrupt_level(DISABLED);
+  }
+
+  message->flow = flow;
+  message->seq = flow->next_seq++;
+  message->header = flow->header;
+  message->header.message_type = RDP_DATA + '0';
+  pack_unsigned_int(message->header.flow_id, flow->send_id);
+  pack_unsigned_int(message->header.seq_number, message->seq);
+  flow->window[message->seq % MINIRDP_WINDOW] = message;
+  flow->in_flight++;
+  flow_touch(flow, currentTimeMillis());
+
+  message->timer = register_alarm(message->timeout, rdp_retransmit, message);
+  if (message->timer) {
+    rdp_transmit(message);
+  }
+  else {
+    flow->given_up++;
+    rdp_settle(message);
+  }
+  set_interrupt_level(old_level);
+
+  return len;
+}
+
+int
+minirdp_flush(miniport_t* local_unbound_port, miniport_t* local_bound_port)
+{
+  network_address_t remote_addr;
+
+  if (!local_unbound_port || !local_bound_port) {
+    return -1;
+  }
+  int remote_port = miniport_get_remote(local_bound_port, remote_addr);
+  if (remote_port == -1) {
+    return -1;
+  }
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  rdp_flow_t *flow = flow_find(miniport_get_number(local_unbound_port), remote_addr, remote_port, N_FALSE);
+  if (!flow) {
+    set_interrupt_level(old_level);
+    return 0;
+  }
+  while (flow->in_flight > 0) {
+    flow->waiting++;
+    set_interrupt_level(old_level);
+    semaphore_P(flow->window_changed);
+    old_level = set_interrupt_level(DISABLED);
+  }
+  int given_up = flow->given_up;
+  flow->given_up = 0;
+  set_interrupt_level(old_level);
+
+  return given_up;
+}
+
+/*
+ * The remote end has received everything before base and, in bits, which
+ * of the window starting at base: settle those of our datagrams. A datagram
+ * that MINIRDP_FAST_RETRANSMIT later ones have overtaken is taken to be lost
+ * and sent again at once, rather than when its alarm goes off. Called from
+ * the network handler, with interrupts disabled.
+ */
+static void rdp_acknowledged(rdp_flow_t *flow, unsigned int base, uint64_t bits)
+{
+  //Nothing can have been received that was never sent
+  if ((int) (base - flow->next_seq) > 0) {
+    return;
+  }
+  unsigned int highest = bits ? base + 63 - __builtin_clzll(bits) : base - 1;
+
+  for (unsigned int seq = flow->send_base; seq != flow->next_seq; seq++) {
+    rdp_message_t *message = flow->window[seq % MINIRDP_WINDOW];
+    unsigned int offset = seq - base;
+    if (!message) {
+      continue;
+    }
+    if ((int) offset < 0 || (offset < 64 && (bits >> offset) & 1)) {
+      deregister_alarm(message->timer);
+      rdp_settle(message);
+    }
+    else if ((int) (highest - seq) >= MINIRDP_FAST_RETRANSMIT && !message->fast_retransmitted) {
+      message->fast_retransmitted = N_TRUE;
+      rdp_transmit(message);
+    }
+  }
+}
+
+//Move the receive window up to base, and past everything received in a row from there
+static void rdp_receive_advance(rdp_flow_t *flow, unsigned int base)
+{
+  if ((int) (base - flow->recv_base) > 0) {
+    unsigned int shift = base - flow->recv_base;
+    flow->recv_bits = (shift < 64) ? flow->recv_bits >> shift : 0;
+    flow->recv_base = base;
+  }
+  int received = (~flow->recv_bits) ? __builtin_ctzll(~flow->recv_bits) : 64;
+  flow->recv_bits = (received < 64) ? flow->recv_bits >> received : 0;
+  flow->recv_base += received;
+}
+
+/*
+ * Datagram seq of the remote end's flow id, which will not send anything
+ * before base again, has arrived. Returns whether it is new; it is only
+ * recorded as received by rdp_received, once minimsg has taken it. Called
+ * with interrupts disabled.
+ */
+static int rdp_is_new(rdp_flow_t *flow, unsigned int id, unsigned int seq, unsigned int base)
+{
+  //A new flow id means the remote end has started over
+  if (!flow->receiving || flow->recv_id != id) {
+    flow->receiving = N_TRUE;
+    flow->recv_id = id;
+    flow->recv_base = base;
+    flow->recv_bits = 0;
+  }
+  rdp_receive_advance(flow, base);
+
+  unsigned int offset = seq - flow->recv_base;
+  return !((int) offset < 0 || offset >= 64 || (flow->recv_bits >> offset) & 1);
+}
+
+//Record the arrival of a new datagram seq. Called with interrupts disabled.
+static void rdp_received(rdp_flow_t *flow, unsigned int seq)
+{
+  flow->recv_bits |= (uint64_t) 1 << (seq - flow->recv_base);
+  rdp_receive_advance(flow, flow->recv_base);
+}
+
+//Tell the remote end what we have of its window. Called with interrupts disabled.
+static void rdp_send_ack(rdp_flow_t *flow)
+{
+  mini_header_rdp_t header = flow->header;
+  header.message_type = RDP_ACK + '0';
+  pack_unsigned_int(header.flow_id, flow->recv_id);
+  pack_unsigned_int(header.window_base, flow->recv_base);
+  pack_unsigned_int(header.ack_bits, (unsigned int) (flow->recv_bits >> 32));
+  pack_unsigned_int(header.ack_bits + 4, (unsigned int) flow->recv_bits);
+  network_send_pkt(flow->remote_addr, sizeof(mini_header_rdp_t), (char *) &header, 0, NULL);
+}
+
+void minirdp_handle_packet(network_interrupt_arg_t *arg)
+{
+  if (arg->size < sizeof(mini_header_rdp_t) || arg->size > MAX_NETWORK_PKT_SIZE) {
+    network_packet_release(arg);
+    return;
+  }
+
+  mini_header_rdp_t *header = (mini_header_rdp_t *) arg->buffer;
+  network_address_t source_address;
+  unpack_address(header->source_address, source_address);
+  int source_port = unpack_unsigned_short(header->source_port);
+  int port = unpack_unsigned_short(header->destination_port);
+  unsigned int id = unpack_unsigned_int(header->flow_id);
+  unsigned int base = unpack_unsigned_int(header->window_base);
+
+  uint64_t now = currentTimeMillis();
+  flow_expire(now);
+
+  if (header->message_type == RDP_ACK + '0') {
+    rdp_flow_t *flow = flow_find(port, source_address, source_port, N_FALSE);
+    if (flow && flow->send_id == id) {
+      uint64_t bits = (uint64_t) unpack_unsigned_int(header->ack_bits) << 32
+                      | unpack_unsigned_int(header->ack_bits + 4);
+      flow_touch(flow, now);
+      rdp_acknowledged(flow, base, bits);
+    }
+    network_packet_release(arg);
+    return;
+  }
+
+  //Datagrams are only acknowledged if there is a port to take them
+  rdp_flow_t *flow = NULL;
+  if (header->message_type != RDP_DATA + '0' || port > MAX_UNBOUND_PORT || !unbound_ports[port]
+      || !(flow = flow_find(port, source_address, source_port, N_TRUE))) {
+    network_packet_release(arg);
+    return;
+  }
+  flow_touch(flow, now);
+  unsigned int seq = unpack_unsigned_int(header->seq_number);
+  if (!rdp_is_new(flow, id, seq, base)) {
+    rdp_send_ack(flow);
+    network_packet_release(arg);
+    return;
+  }
+
+  //Hand the datagram to minimsg, with a plain datagram header right before the payload
+  int extra = sizeof(mini_header_rdp_t) - sizeof(mini_header_t);
+  memmove(arg->buffer + extra, arg->buffer, sizeof(mini_header_t));
+  arg->buffer += extra;
+  arg->size -= extra;
+
+  //One that the port has no room for is not acknowledged, so that it is sent again
+  if (minimsg_deliver_reliable(arg) == 0) {
+    rdp_received(flow, seq);
+    rdp_send_ack(flow);
+  }
+}
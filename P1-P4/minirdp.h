@@ -0,0 +1,57 @@
+#ifndef __MINIRDP_H__
+#define __MINIRDP_H__
+/*
+ *  Definitions for reliable datagrams.
+ *
+ *      Reliable datagrams are minimsgs that are acknowledged by their
+ *      receiver and retransmitted until they are, without any connection
+ *      to set up first and without any ordering between them. They are
+ *      sent through the same miniports as minimsgs and received with the
+ *      minimsg receive functions, each exactly once, as long as the sender
+ *      has not given up on it. A datagram is only acknowledged once it is
+ *      on the queue of its port; one that the port has no room for is sent
+ *      again, and once queued it is never dropped to make room for others.
+ *
+ *      Every datagram carries a sequence number of the flow between its
+ *      local unbound port and the remote endpoint. Up to MINIRDP_WINDOW
+ *      sequence numbers may be outstanding on a flow at once; receivers
+ *      acknowledge what they have of that window in every acknowledgment,
+ *      so that only what is missing is sent again. A datagram is
+ *      retransmitted after MINIRDP_INITIAL_TIMEOUT milliseconds, twice as
+ *      long after each retransmission, and given up after
+ *      MINIRDP_MAX_RETRIES of them; it is also retransmitted, once, as soon
+ *      as MINIRDP_FAST_RETRANSMIT later datagrams are known to have arrived.
+ *      A flow that has been idle for MINIRDP_FLOW_TIMEOUT milliseconds is
+ *      forgotten.
+ */
+#include "network.h"
+#include "minimsg.h"
+#include "miniheader.h"
+
+#define MINIRDP_MAX_MSG_SIZE (MAX_NETWORK_PKT_SIZE - (int) sizeof(mini_header_rdp_t))
+#define MINIRDP_WINDOW 64
+#define MINIRDP_INITIAL_TIMEOUT 200
+#define MINIRDP_MAX_RETRIES 5
+#define MINIRDP_FAST_RETRANSMIT 3
+#define MINIRDP_FLOW_TIMEOUT 60000
+
+/* performs any required initialization of the reliable datagram layer. */
+void minirdp_initialize();
+
+/* Sends a message through a locally bound port, with replies going to local_unbound_port,
+ * like minimsg_send, and keeps a copy of it to retransmit until it is acknowledged. Returns
+ * as soon as the message has been sent once, unless MINIRDP_WINDOW datagrams of the flow are
+ * outstanding, in which case it first waits for the oldest of them to be acknowledged or
+ * given up. Returns the number of payload bytes sent, or -1 on invalid arguments or if the
+ * message is longer than MINIRDP_MAX_MSG_SIZE.
+ */
+int minirdp_send(miniport_t* local_unbound_port, miniport_t* local_bound_port, minimsg_t* msg, int len);
+
+/* Waits until every datagram sent from local_unbound_port through local_bound_port has been
+ * acknowledged or given up. Returns the number given up since the last call, or -1 on
+ * invalid arguments.
+ */
+int minirdp_flush(miniport_t* local_unbound_port, miniport_t* local_bound_port);
+
+void minirdp_handle_packet(network_interrupt_arg_t *arg);
+#endif /*__MINIRDP_H__*/
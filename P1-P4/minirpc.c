@@ -0,0 +1,403 @@
+/*
+ *  Implementation of remote procedure calls.
+ */
+#include "minirpc.h"
+#include "minithread.h"
+#include "interrupts.h"
+#include "alarm.h"
+#include "synch.h"
+#include "slab.h"
+#include "machineprimitives.h"
+#include <stdlib.h>
+#include <string.h>
+
+//Size of the table of pending calls of a client
+#define PENDING_BUCKETS 256
+//Most responses the receiver of a client takes off its port at once
+#define RECEIVE_BATCH 32
+
+/*
+ * A client. Its receiver thread takes the responses off its port and hands
+ * them to the calls in its pending table, by call id.
+ */
+struct minirpc_client
+{
+  miniport_t *port;
+  miniport_t *server;
+  //Bound to our own port, to stop the receiver with
+  miniport_t *self;
+  unsigned int next_id;
+  //The id of the message that stops the receiver, so that nobody else can send it
+  unsigned int shutdown_id;
+  minirpc_call_t *pending[PENDING_BUCKETS];
+  semaphore_t *stopped;
+};
+
+/*
+ * A call. It is in the pending table of its client from just before its
+ * request is sent until its response arrives or its alarm goes off,
+ * whichever is first; then done is V'ed, and minirpc_call_wait frees it.
+ * Protected by disabling interrupts while it is pending.
+ */
+struct minirpc_call
+{
+  minirpc_client_t *client;
+  unsigned int id;
+  int status;
+  alarm_id timer;
+  minimsg_view_t response;
+  semaphore_t *done;
+  minirpc_call_t *next;
+};
+
+struct minirpc_server
+{
+  miniport_t *port;
+  struct
+  {
+    minirpc_handler_t handler;
+    void *arg;
+  } procedures[MINIRPC_MAX_PROCEDURES];
+};
+
+//A worker thread of a server, and the member of the server's port group that it receives on
+typedef struct rpc_worker
+{
+  minirpc_server_t *server;
+  miniport_t *port;
+} rpc_worker_t;
+
+//The unbound ports of minimsg, to tell whether a port number is in use
+extern miniport_t *unbound_ports[MAX_PORTS];
+
+//Object cache for calls; the done semaphore stays with a call while it is cached
+static slab_cache_t *call_cache;
+
+static void minirpc_call_construct(void *object)
+{
+  minirpc_call_t *call = (minirpc_call_t *) object;
+  call->done = semaphore_create();
+}
+
+void
+minirpc_initialize()
+{
+  call_cache = slab_cache_create("minirpc_call_t", sizeof(minirpc_call_t), minirpc_call_construct);
+}
+
+static void pack_rpc_header(mini_header_rpc_t *header, int msg_type, unsigned int id, int procedure, int status)
+{
+  header->message_type = msg_type + '0';
+  pack_unsigned_int(header->call_id, id);
+  pack_unsigned_short(header->procedure, (unsigned short) procedure);
+  header->status = status + '0';
+}
+
+/*
+ * Take a call off the pending table of its client. Returns NULL if it is
+ * not there. Called with interrupts disabled.
+ */
+static minirpc_call_t *pending_remove(minirpc_client_t *client, unsigned int id)
+{
+  minirpc_call_t **link = &client->pending[id % PENDING_BUCKETS];
+  while (*link && (*link)->id != id)
+    link = &(*link)->next;
+
+  minirpc_call_t *call = *link;
+  if (call) {
+    *link = call->next;
+  }
+  return call;
+}
+
+//Alarm handler: a call has not been answered in time
+static void rpc_call_timeout(void *arg)
+{
+  minirpc_call_t *call = (minirpc_call_t *) arg;
+
+  //The alarm goes away by itself once it has gone off
+  call->timer = NULL;
+  if (pending_remove(call->client, call->id) == call) {
+    call->status = MINIRPC_TIMEOUT;
+    semaphore_V(call->done);
+  }
+}
+
+/*
+ * The receiver thread of a client: hands each response to its call, and
+ * drops the ones whose call has timed out already.
+ */
+static int rpc_client_receiver(int *arg)
+{
+  minirpc_client_t *client = (minirpc_client_t *) arg;
+  minimsg_view_t views[RECEIVE_BATCH];
+  int running = 1;
+
+  while (running) {
+    int count = minimsg_receive_many(client->port, NULL, views, RECEIVE_BATCH);
+    for (int i = 0; i < count; i++) {
+      const mini_header_rpc_t *header = (const mini_header_rpc_t *) views[i].msg;
+      if (views[i].len < (int) sizeof(mini_header_rpc_t)) {
+        minimsg_release(&views[i]);
+        continue;
+      }
+      unsigned int id = unpack_unsigned_int(header->call_id);
+      if (header->message_type == RPC_SHUTDOWN + '0' && id == client->shutdown_id) {
+        running = 0;
+      }
+      if (header->message_type != RPC_RESPONSE + '0') {
+        minimsg_release(&views[i]);
+        continue;
+      }
+
+      interrupt_level_t old_level = set_interrupt_level(DISABLED);
+      minirpc_call_t *call = pending_remove(client, id);
+      if (call && call->timer) {
+        deregister_alarm(call->timer);
+      }
+      set_interrupt_level(old_level);
+
+      if (!call) {
+        minimsg_release(&views[i]);
+        continue;
+      }
+      //Lend the response to the call until minirpc_call_wait copies it out
+      call->status = header->status - '0';
+      call->response = views[i];
+      semaphore_V(call->done);
+    }
+  }
+
+  semaphore_V(client->stopped);
+  return 0;
+}
+
+minirpc_client_t*
+minirpc_client_create(int local_port, network_address_t addr, int server_port)
+{
+  network_address_t local_host;
+
+  if (!addr || local_port < MIN_UNBOUND_PORT || local_port > MAX_UNBOUND_PORT || unbound_ports[local_port]) {
+    return NULL;
+  }
+  minirpc_client_t *client = (minirpc_client_t *) malloc(sizeof(minirpc_client_t));
+  if (!client) {
+    return NULL;
+  }
+
+  network_get_my_address(local_host);
+  client->port = miniport_create_unbound(local_port);
+  client->server = miniport_create_bound(addr, server_port);
+  client->self = miniport_create_bound(local_host, local_port);
+  if (!client->port || !client->server || !client->self) {
+    if (client->port)
+      miniport_destroy(client->port);
+    if (client->server)
+      miniport_destroy(client->server);
+    if (client->self)
+      miniport_destroy(client->self);
+    free(client);
+    return NULL;
+  }
+
+  client->next_id = 0;
+  client->shutdown_id = (unsigned int) currentTimeMillis() * 2654435761u ^ (unsigned int) local_port;
+  memset(client->pending, 0, sizeof(client->pending));
+  client->stopped = semaphore_create();
+  semaphore_initialize(client->stopped, 0);
+
+  minithread_fork(rpc_client_receiver, (arg_t) client);
+  return client;
+}
+
+void
+minirpc_client_destroy(minirpc_client_t* client)
+{
+  mini_header_rpc_t header;
+
+  if (!client) {
+    return;
+  }
+  //Stop the receiver with a message of its own, which reaches it behind any responses
+  pack_rpc_header(&header, RPC_SHUTDOWN, client->shutdown_id, 0, MINIRPC_OK);
+  minirdp_send(client->port, client->self, (minimsg_t *) &header, sizeof(mini_header_rpc_t));
+  semaphore_P(client->stopped);
+
+  miniport_destroy(client->self);
+  miniport_destroy(client->server);
+  miniport_destroy(client->port);
+  semaphore_destroy(client->stopped);
+  free(client);
+}
+
+minirpc_call_t*
+minirpc_call_start(minirpc_client_t* client, int procedure, const char* request, int len, int timeout)
+{
+  char message[MINIRDP_MAX_MSG_SIZE];
+
+  if (!client || procedure < 0 || procedure >= MINIRPC_MAX_PROCEDURES || len < 0
+      || len > MINIRPC_MAX_MSG_SIZE || (len > 0 && !request) || timeout < 0) {
+    return NULL;
+  }
+  minirpc_call_t *call = (minirpc_call_t *) slab_alloc(call_cache);
+  if (!call) {
+    return NULL;
+  }
+  call->client = client;
+  call->status = MINIRPC_ERROR;
+  call->timer = NULL;
+  call->response.msg = NULL;
+  call->response.len = 0;
+  call->response.packet = NULL;
+  semaphore_initialize(call->done, 0);
+
+  //The call must be pending before the response can possibly arrive
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  call->id = client->next_id++;
+  call->next = client->pending[call->id % PENDING_BUCKETS];
+  client->pending[call->id % PENDING_BUCKETS] = call;
+  call->timer = register_alarm(timeout ? timeout : MINIRPC_DEFAULT_TIMEOUT, rpc_call_timeout, call);
+  set_interrupt_level(old_level);
+
+  pack_rpc_header((mini_header_rpc_t *) message, RPC_REQUEST, call->id, procedure, MINIRPC_OK);
+  memcpy(message + sizeof(mini_header_rpc_t), request, len);
+
+  if (!call->timer
+      || minirdp_send(client->port, client->server, message, sizeof(mini_header_rpc_t) + len) == -1) {
+    old_level = set_interrupt_level(DISABLED);
+    if (pending_remove(client, call->id) == call) {
+      if (call->timer) {
+        deregister_alarm(call->timer);
+      }
+      call->status = MINIRPC_ERROR;
+      semaphore_V(call->done);
+    }
+    set_interrupt_level(old_level);
+  }
+  return call;
+}
+
+int
+minirpc_call_wait(minirpc_call_t* call, char* response, int* len)
+{
+  if (!call) {
+    return MINIRPC_ERROR;
+  }
+  semaphore_P(call->done);
+
+  int status = call->status;
+  int response_len = 0;
+  if (call->response.packet) {
+    response_len = call->response.len - sizeof(mini_header_rpc_t);
+    if (response && len) {
+      memcpy(response, call->response.msg + sizeof(mini_header_rpc_t),
+             (response_len < *len) ? response_len : *len);
+    }
+    minimsg_release(&call->response);
+  }
+  if (len) {
+    *len = response_len;
+  }
+
+  slab_free(call_cache, call);
+  return status;
+}
+
+int
+minirpc_call(minirpc_client_t* client, int procedure, const char* request, int request_len,
+             char* response, int* response_len, int timeout)
+{
+  minirpc_call_t *call = minirpc_call_start(client, procedure, request, request_len, timeout);
+  if (!call) {
+    if (response_len)
+      *response_len = 0;
+    return MINIRPC_ERROR;
+  }
+  return minirpc_call_wait(call, response, response_len);
+}
+
+/*
+ * A worker thread of a server: runs the handler of each request that comes
+ * to its member of the port group, and sends back the response, which the
+ * handler writes right behind its header.
+ */
+static int rpc_server_worker(int *arg)
+{
+  rpc_worker_t *worker = (rpc_worker_t *) arg;
+  char response[MINIRDP_MAX_MSG_SIZE];
+  minimsg_view_t request;
+  miniport_t *client;
+
+  for (;;) {
+    client = NULL;
+    int request_len = minimsg_receive_zc(worker->port, &client, &request) - (int) sizeof(mini_header_rpc_t);
+    const mini_header_rpc_t *header = (const mini_header_rpc_t *) request.msg;
+    if (request_len < 0 || header->message_type != RPC_REQUEST + '0' || !client) {
+      minimsg_release(&request);
+      if (client)
+        miniport_destroy(client);
+      continue;
+    }
+
+    unsigned int id = unpack_unsigned_int(header->call_id);
+    int procedure = unpack_unsigned_short(header->procedure);
+    int status = MINIRPC_NOPROC;
+    int len = 0;
+    if (procedure < MINIRPC_MAX_PROCEDURES && worker->server->procedures[procedure].handler) {
+      len = worker->server->procedures[procedure].handler(worker->server->procedures[procedure].arg,
+                                                          request.msg + sizeof(mini_header_rpc_t), request_len,
+                                                          response + sizeof(mini_header_rpc_t),
+                                                          MINIRPC_MAX_MSG_SIZE);
+      status = (len >= 0 && len <= MINIRPC_MAX_MSG_SIZE) ? MINIRPC_OK : MINIRPC_FAILED;
+      if (status != MINIRPC_OK)
+        len = 0;
+    }
+    minimsg_release(&request);
+
+    pack_rpc_header((mini_header_rpc_t *) response, RPC_RESPONSE, id, procedure, status);
+    minirdp_send(worker->port, client, response, sizeof(mini_header_rpc_t) + len);
+    miniport_destroy(client);
+  }
+  return 0;
+}
+
+minirpc_server_t*
+minirpc_server_create(int port, int threads)
+{
+  if (threads < 1) {
+    return NULL;
+  }
+  minirpc_server_t *server = (minirpc_server_t *) malloc(sizeof(minirpc_server_t));
+  rpc_worker_t *workers = (rpc_worker_t *) malloc(threads * sizeof(rpc_worker_t));
+  if (!server || !workers) {
+    free(server);
+    free(workers);
+    return NULL;
+  }
+  memset(server->procedures, 0, sizeof(server->procedures));
+
+  //Requests need no ordering, so they go to the workers in turn
+  server->port = miniport_create_group(port, threads, MINIPORT_GROUP_ROUND_ROBIN);
+  if (!server->port) {
+    free(server);
+    free(workers);
+    return NULL;
+  }
+  for (int i = 0; i < threads; i++) {
+    workers[i].server = server;
+    workers[i].port = miniport_group_member(server->port, i);
+    minithread_fork(rpc_server_worker, (arg_t) &workers[i]);
+  }
+  return server;
+}
+
+int
+minirpc_server_register(minirpc_server_t* server, int procedure, minirpc_handler_t handler, void* arg)
+{
+  if (!server || procedure < 0 || procedure >= MINIRPC_MAX_PROCEDURES || !handler) {
+    return -1;
+  }
+  server->procedures[procedure].handler = handler;
+  server->procedures[procedure].arg = arg;
+  return 0;
+}
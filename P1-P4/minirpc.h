@@ -0,0 +1,96 @@
+#ifndef __MINIRPC_H__
+#define __MINIRPC_H__
+/*
+ *  Definitions for remote procedure calls.
+ *
+ *      A client sends requests from its own unbound port to the unbound
+ *      port of a server, as reliable datagrams (minirdp.h), each tagged
+ *      with a call id, and matches the responses to the calls that are
+ *      waiting for them by that id. Any number of calls may be outstanding
+ *      on one client at once, started by one thread or by many, and they
+ *      may complete in any order. A call that has not been answered within
+ *      its timeout, measured with the alarm system, fails.
+ *
+ *      A server is a port group (minimsg.h) with a worker thread for each
+ *      member; each request is handed to the next worker in turn, which
+ *      runs the handler registered for its procedure and sends back what
+ *      the handler wrote.
+ */
+#include "network.h"
+#include "minimsg.h"
+#include "minirdp.h"
+
+/* The largest request or response. */
+#define MINIRPC_MAX_MSG_SIZE (MINIRDP_MAX_MSG_SIZE - (int) sizeof(mini_header_rpc_t))
+
+/* The timeout of a call that does not give one: long enough for reliable datagrams to
+ * give up on both the request and the response, after which it could never complete.
+ */
+#define MINIRPC_DEFAULT_TIMEOUT (2 * MINIRDP_INITIAL_TIMEOUT * ((2 << MINIRDP_MAX_RETRIES) - 1))
+
+/* Procedures are numbered from 0 to MINIRPC_MAX_PROCEDURES - 1. */
+#define MINIRPC_MAX_PROCEDURES 256
+
+/* How a call ended. */
+enum {
+  MINIRPC_OK = 0,
+  MINIRPC_TIMEOUT,      /* no response within the timeout */
+  MINIRPC_NOPROC,       /* the server has no handler for the procedure */
+  MINIRPC_FAILED,       /* the handler failed */
+  MINIRPC_ERROR         /* invalid arguments, or out of memory */
+};
+
+typedef struct minirpc_client minirpc_client_t;
+typedef struct minirpc_call minirpc_call_t;
+typedef struct minirpc_server minirpc_server_t;
+
+/*
+ * A procedure of a server. It is given the request_len bytes of the request,
+ * and writes its response, of at most max_len bytes, to response. Returns the
+ * length of the response, or -1 if it failed. Handlers run in the worker
+ * threads of the server, several at a time.
+ */
+typedef int (*minirpc_handler_t)(void* arg, const char* request, int request_len,
+                                 char* response, int max_len);
+
+/* performs any required initialization of the RPC layer. */
+void minirpc_initialize();
+
+/* Creates a client that calls the server at server_port of addr, and receives the
+ * responses on its unbound port local_port, which must not be in use. Returns NULL
+ * on error.
+ */
+minirpc_client_t* minirpc_client_create(int local_port, network_address_t addr, int server_port);
+
+/* Destroys a client. It must not have any calls outstanding. */
+void minirpc_client_destroy(minirpc_client_t* client);
+
+/* Starts a call of a procedure with a request of len bytes, to fail if it has not been
+ * answered within timeout milliseconds (0 for MINIRPC_DEFAULT_TIMEOUT). Returns at once,
+ * with the call to wait for, or NULL on invalid arguments.
+ */
+minirpc_call_t* minirpc_call_start(minirpc_client_t* client, int procedure, const char* request,
+                                   int len, int timeout);
+
+/* Waits for a call to end, and frees it. Copies up to *len bytes of the response into
+ * response, and sets *len to the length of the response (0 if the call failed). Returns
+ * the MINIRPC_* status of the call.
+ */
+int minirpc_call_wait(minirpc_call_t* call, char* response, int* len);
+
+/* Calls a procedure and waits for it: minirpc_call_start followed by minirpc_call_wait. */
+int minirpc_call(minirpc_client_t* client, int procedure, const char* request, int request_len,
+                 char* response, int* response_len, int timeout);
+
+/* Creates a server on the unbound port port with threads worker threads. Its procedures
+ * must be registered before any client calls them. Servers are never destroyed. Returns
+ * NULL if the port is in use, or on error.
+ */
+minirpc_server_t* minirpc_server_create(int port, int threads);
+
+/* Registers the handler of a procedure, which is passed arg on every call. Returns 0 on
+ * success, -1 on invalid arguments.
+ */
+int minirpc_server_register(minirpc_server_t* server, int procedure, minirpc_handler_t handler, void* arg);
+
+#endif /*__MINIRPC_H__*/
@@ -6,6 +6,8 @@
 #include "alarm.h"
 #include <stdio.h>
 #include "interrupts.h"
+#include "slab.h"
+#include "portalloc.h"
 
 struct minisocket
 {
@@ -22,45 +24,55 @@ struct minisocket
   int ack_flag;
   semaphore_t *wait_for_ack;
   semaphore_t *send_receive_mutex;
+  mini_header_reliable_t header;  // packed once the remote end is known
 };
 
 minisocket_t *ports[N_PORTS];
-static int n_client_ports;
+//Hands out client port numbers
+static port_allocator_t *client_ports;
 //static int fragment_length = MAX_NETWORK_PKT_SIZE - sizeof(mini_header_reliable_t);
 static void send_control_message(int, unsigned int, network_address_t, unsigned int,
 				 unsigned int, unsigned int, minisocket_error *);
 static void minisocket_free (minisocket_t *);
 static network_address_t local_host;
 static semaphore_t *ports_mutex;
+//Object cache for sockets
+static slab_cache_t *socket_cache;
+
+/*
+ * Socket constructor, run once per cached socket. The data queue and the
+ * semaphores stay with the socket when it is freed and are only
+ * re-initialized when the socket is reused.
+ */
+static void minisocket_construct(void *object)
+{
+  minisocket_t *socket = (minisocket_t *) object;
+  socket->data = queue_new();
+  socket->data_ready = semaphore_create();
+  socket->wait_for_ack = semaphore_create();
+  socket->send_receive_mutex = semaphore_create();
+}
 
 void minisocket_initialize()
 {
+  socket_cache = slab_cache_create("minisocket_t", sizeof(minisocket_t), minisocket_construct);
+
   for (int i = 0; i < N_PORTS; i++) {
     ports[i] = NULL;
   }
   ports_mutex = semaphore_create();
   semaphore_initialize(ports_mutex, 1);
   
-  n_client_ports = MIN_CLIENT_PORT;
+  client_ports = port_allocator_new(MIN_CLIENT_PORT, N_CLIENT_PORTS);
   network_get_my_address(local_host);
 }
 
-static mini_header_reliable_t *create_control_header(int msg_type, unsigned int dest_port,
-						    network_address_t dest_addr, unsigned int src_port,
-						     unsigned int seq, unsigned int ack)
+static void pack_control_header(mini_header_reliable_t *header, int msg_type,
+				unsigned int dest_port, network_address_t dest_addr,
+				unsigned int src_port, unsigned int seq, unsigned int ack)
 {
-  mini_header_reliable_t *header = (mini_header_reliable_t *) malloc(sizeof(mini_header_reliable_t));
-  if (!header) {
-    return NULL;
-  }
-    
   header->protocol = PROTOCOL_MINISTREAM + '0';
-
-  network_address_t local_addr;
-  network_address_copy(local_host, local_addr);
-  //network_get_my_address(local_addr);
-
-  pack_address(header->source_address, local_addr);
+  pack_address(header->source_address, local_host);
   pack_unsigned_short(header->source_port, src_port);
 
   header->message_type = msg_type + '0';
@@ -68,26 +80,52 @@ static mini_header_reliable_t *create_control_header(int msg_type, unsigned int
   pack_unsigned_short(header->destination_port, dest_port);
   pack_unsigned_int(header->seq_number, seq); 
   pack_unsigned_int(header->ack_number, ack); 
-  return header;
 }
 
+/*
+ * Pack the socket's header template, once both ends of the connection are
+ * known. Every message of the socket starts as a copy of it.
+ */
+static void build_header_template(minisocket_t *socket)
+{
+  pack_control_header(&socket->header, 0, socket->remote_port, socket->remote_addr,
+		      socket->local_port, 0, 0);
+}
+
+/* copy the socket's template and fill in the fields that change per message */
+static void patch_header(minisocket_t *socket, mini_header_reliable_t *header,
+			 int msg_type, unsigned int seq, unsigned int ack)
+{
+  *header = socket->header;
+  header->message_type = msg_type + '0';
+  pack_unsigned_int(header->seq_number, seq); 
+  pack_unsigned_int(header->ack_number, ack); 
+}
+
+static void send_header(network_address_t dest_addr, mini_header_reliable_t *header,
+			minisocket_error *error)
+{
+  int result = network_send_pkt(dest_addr, sizeof(mini_header_reliable_t), (char *) header, 0, NULL);
+  *error = (result == -1) ? SOCKET_SENDERROR : SOCKET_NOERROR;
+}
+
+/* send a control message to an endpoint we have no connection with */
 static void send_control_message(int msg_type, unsigned int dest_port,
 				 network_address_t dest_addr, unsigned int src_port,
 				 unsigned int seq, unsigned int ack, minisocket_error *error)
 {
-  mini_header_reliable_t *header = create_control_header(msg_type, dest_port,
-							 dest_addr, src_port,
-							 seq, ack);
-  if (!header) {
-    *error = SOCKET_OUTOFMEMORY;
-    return;
-  }
+  mini_header_reliable_t header;
+  pack_control_header(&header, msg_type, dest_port, dest_addr, src_port, seq, ack);
+  send_header(dest_addr, &header, error);
+}
 
-  if (network_send_pkt(dest_addr, sizeof(mini_header_reliable_t), (char *) header, 0, NULL) == -1)
-  {
-    *error = SOCKET_SENDERROR;
-    return;
-  }
+/* send a control message to the other end of the socket */
+static void send_socket_message(minisocket_t *socket, int msg_type, unsigned int seq,
+				unsigned int ack, minisocket_error *error)
+{
+  mini_header_reliable_t header;
+  patch_header(socket, &header, msg_type, seq, ack);
+  send_header(socket->remote_addr, &header, error);
 }
 
 minisocket_t* minisocket_server_create(int port, minisocket_error *error)
@@ -101,7 +139,7 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error)
     return NULL;
   }
 
-  minisocket_t *new_socket =  (minisocket_t *) malloc(sizeof(minisocket_t));
+  minisocket_t *new_socket =  (minisocket_t *) slab_alloc(socket_cache);
   if (!new_socket) {
     *error = SOCKET_OUTOFMEMORY;
     return NULL;
@@ -115,11 +153,7 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error)
   new_socket->local_port = port;
   network_address_copy(local_host, new_socket->local_addr);
 
-  new_socket->data = queue_new();
-  new_socket->data_ready = semaphore_create();
   new_socket->ack_flag = 0;
-  new_socket->wait_for_ack = semaphore_create();
-  new_socket->send_receive_mutex = semaphore_create();
   semaphore_initialize(new_socket->data_ready, 0);
   semaphore_initialize(new_socket->wait_for_ack, 0);
   semaphore_initialize(new_socket->send_receive_mutex, 1);
@@ -143,19 +177,21 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error)
       if (header->message_type -'0'== MSG_SYN) {
 	unpack_address(header->source_address, new_socket->remote_addr);
 	new_socket->remote_port = unpack_unsigned_short(header->source_port);
+	build_header_template(new_socket);
 	new_socket->socket_state = WAITING_ACK;
 	new_socket->seq_number = 0;
 	new_socket->ack_number = 1;
+	network_packet_release(arg);
 	break;
       }
       else {
-	free(arg);
+	network_packet_release(arg);
       }
     }
     minisocket_error s_error;
     int wait_val = 100;
     while (wait_val <= 12800) {
-      send_control_message(MSG_SYNACK, new_socket->remote_port, new_socket->remote_addr, new_socket->local_port, 0 , 1, &s_error);
+      send_socket_message(new_socket, MSG_SYNACK, 0 , 1, &s_error);
       new_socket->seq_number = 1;
       new_socket->ack_number = 1;
       if (s_error == SOCKET_OUTOFMEMORY) {
@@ -186,6 +222,7 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error)
       if (header->message_type - '0' == MSG_SYN) {
 
 	if (new_socket->remote_port == sport && network_compare_network_addresses(new_socket->remote_addr, saddr)) {
+	  network_packet_release(arg);
 	  continue;
 	}
 	send_control_message(MSG_FIN, sport, saddr, new_socket->local_port, 0, 0, &s_error);
@@ -196,16 +233,17 @@ minisocket_t* minisocket_server_create(int port, minisocket_error *error)
 	  
 	  network_interrupt_arg_t *packet = NULL;
 	  while (queue_dequeue(new_socket->data, (void **)&packet) != -1) {
-	    free(packet);
+	    network_packet_release(packet);
 	  }
 	  semaphore_initialize(new_socket->data_ready, 0);
 	  new_socket->socket_state = OPEN;
 	  new_socket->seq_number = 1;
 	  new_socket->ack_number = 2;
+	  network_packet_release(arg);
 	  return new_socket;
 	}
       }
-      free (arg);
+      network_packet_release(arg);
     }
   }
   return NULL;
@@ -219,31 +257,15 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
     return NULL;
   }
 
-  int port_val = -1;
-  // CHECK what n_client_ports does
-  if (!ports[n_client_ports]) {
-    port_val = n_client_ports;
-  }
-  else {
-    for (int i = MIN_CLIENT_PORT; i <= MAX_CLIENT_PORT; i++) {
-      if (!ports[i]) {
-	port_val = i;
-	break;
-      }
-    }
-  }
-  n_client_ports = port_val + 1;
-  if (n_client_ports > MAX_CLIENT_PORT) {
-    n_client_ports = 0;
-  }
-    
+  int port_val = port_allocator_get(client_ports);
   if (port_val == -1) {
     *error = SOCKET_NOMOREPORTS;
     return NULL;
   }
 
-  minisocket_t *new_socket =  (minisocket_t *) malloc(sizeof(minisocket_t));
+  minisocket_t *new_socket =  (minisocket_t *) slab_alloc(socket_cache);
   if (!new_socket) {
+    port_allocator_put(client_ports, port_val);
     *error = SOCKET_OUTOFMEMORY;
     return NULL;
   }
@@ -259,10 +281,7 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
   new_socket->local_port = port_val;
   network_address_copy(addr, new_socket->remote_addr);
   new_socket->remote_port = port;
-  new_socket->data = queue_new();
-  new_socket->data_ready = semaphore_create();
-  new_socket->wait_for_ack = semaphore_create();
-  new_socket->send_receive_mutex = semaphore_create();
+  build_header_template(new_socket);
   semaphore_initialize(new_socket->data_ready, 0);
   semaphore_initialize(new_socket->wait_for_ack, 0);
   semaphore_initialize(new_socket->send_receive_mutex, 1);
@@ -273,7 +292,7 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
   interrupt_level_t old_level;
   while (wait_val <= 12800) {
 
-    send_control_message(MSG_SYN, new_socket->remote_port, new_socket->remote_addr, new_socket->local_port, 0, 0, &s_error);
+    send_socket_message(new_socket, MSG_SYN, 0, 0, &s_error);
     new_socket->seq_number = 1;
     new_socket->ack_number = 0;   
     if (s_error == SOCKET_OUTOFMEMORY) {
@@ -306,7 +325,8 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
       if (header->message_type - '0' == MSG_SYNACK) {
 	new_socket->seq_number = 1;
 	new_socket->ack_number = 1;
-	send_control_message(MSG_ACK, new_socket->remote_port, new_socket->remote_addr, new_socket->local_port, 1, 1, &s_error);
+	send_socket_message(new_socket, MSG_ACK, 1, 1, &s_error);
+	network_packet_release(arg);
 	if (s_error == SOCKET_OUTOFMEMORY) {
 	  minisocket_free(new_socket);
 	  semaphore_P(ports_mutex);
@@ -317,7 +337,7 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
 	}
 	network_interrupt_arg_t *packet = NULL;
 	while (queue_dequeue(new_socket->data, (void **)&packet) != -1) {
-	  free(packet);
+	  network_packet_release(packet);
 	}
 	semaphore_initialize(new_socket->data_ready, 0);
 	new_socket->socket_state = OPEN;
@@ -326,11 +346,12 @@ minisocket_t* minisocket_client_create(const network_address_t addr, int port, m
 	return new_socket;
       }
       if (header->message_type -'0' == MSG_FIN) {
+	network_packet_release(arg);
 	minisocket_free(new_socket);
 	return NULL;
       }
     }
-    free(arg);
+    network_packet_release(arg);
   }
   minisocket_free(new_socket);
   return NULL;
@@ -355,16 +376,16 @@ int minisocket_send(minisocket_t *socket, const char *msg, int len, minisocket_e
 
   do {
     int wait = 100;
-    mini_header_reliable_t *header = create_control_header(MSG_ACK, socket->remote_port,
-							   socket->remote_addr, socket->local_port,
-							   socket->seq_number, socket->ack_number);
+    mini_header_reliable_t header;
+    patch_header(socket, &header, MSG_ACK, socket->seq_number, socket->ack_number);
     
     transfer_length = len - sent_byte > fragment_length ? fragment_length : len - sent_byte;
     while (wait <= 12800) {
       socket->ack_flag = 0;
-      int res = network_send_pkt(socket->remote_addr, sizeof(mini_header_reliable_t),
-				 (char *)header, transfer_length, msg + sent_byte);
+      // Advance before sending, the ACK may be handled before the send returns
       socket->seq_number += transfer_length;
+      int res = network_send_pkt(socket->remote_addr, sizeof(mini_header_reliable_t),
+				 (char *) &header, transfer_length, msg + sent_byte);
       if (res == -1) {
         *error = SOCKET_SENDERROR;
 	semaphore_V(socket->send_receive_mutex);
@@ -372,11 +393,16 @@ int minisocket_send(minisocket_t *socket, const char *msg, int len, minisocket_e
       }
       alarm_id a = register_alarm(wait, (alarm_handler_t) semaphore_V, socket->data_ready);
       semaphore_P(socket->wait_for_ack);
-      if (socket->socket_state == CLOSED || socket->socket_state == CLOSING) {
-	*error=SOCKET_SENDERROR;
-	return 0;
-      }
       interrupt_level_t old_level = set_interrupt_level(DISABLED);
+      // The last ACK and the FIN can be handled in the same burst, before we run:
+      // data that was acknowledged has been sent even if the socket is closing now
+      if (socket->ack_flag == 0
+          && (socket->socket_state == CLOSED || socket->socket_state == CLOSING)) {
+        *error = SOCKET_SENDERROR;
+        semaphore_V(socket->send_receive_mutex);
+        set_interrupt_level(old_level);
+        return sent_byte;
+      }
       // Function was woken up by the firing of the alarm
       if (socket->ack_flag == 0) {
         wait *= 2;
@@ -400,6 +426,10 @@ int minisocket_send(minisocket_t *socket, const char *msg, int len, minisocket_e
       semaphore_V(socket->send_receive_mutex);
       return (sent_byte == 0) ? -1 : sent_byte; 
     }
+    if (sent_byte != len && (socket->socket_state == CLOSED || socket->socket_state == CLOSING)) {
+      *error = SOCKET_SENDERROR;
+      return sent_byte;
+    }
   } while (sent_byte != len);
   semaphore_V(socket->send_receive_mutex);
   return len;
@@ -441,28 +471,26 @@ int minisocket_receive(minisocket_t *socket, char *msg, int max_len, minisocket_
   }
 
   //If the packet contained more data than the buffer could take, then enqueue the packet with the remaining message again
-  if(copy_len > max_len)
+  if(msg_len > copy_len)
   {
-    mini_header_reliable_t *h = (mini_header_reliable_t *) malloc(sizeof(mini_header_reliable_t));
-
-    if(!h)
-    {
-      *error = SOCKET_OUTOFMEMORY;
-      semaphore_V(socket->send_receive_mutex);
-      return -1;
-    }
-
-    
     mini_header_reliable_t *header = (mini_header_reliable_t *) arg->buffer;
     //Update the sequence number in the header
     unsigned int seq_no = unpack_unsigned_int(header->seq_number);
-    pack_unsigned_int(header->seq_number, seq_no + max_len);
+    pack_unsigned_int(header->seq_number, seq_no + copy_len);
     //Copy the remaining message to the start of the message space in the buffer
-    memcpy(arg->buffer + sizeof(mini_header_reliable_t), arg->buffer + sizeof(mini_header_reliable_t) + max_len, msg_len - max_len);
+    memmove(arg->buffer + sizeof(mini_header_reliable_t), arg->buffer + sizeof(mini_header_reliable_t) + copy_len, msg_len - copy_len);
     //Set the packet size to its correct length
-    arg->size = msg_len + sizeof(mini_header_reliable_t);
-    //Prepend the packet in the data queue
-    queue_prepend(socket->data, &arg);
+    arg->size = msg_len - copy_len + sizeof(mini_header_reliable_t);
+    //Prepend the packet in the data queue and make it available again
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    queue_prepend(socket->data, arg);
+    semaphore_V(socket->data_ready);
+    set_interrupt_level(old_level);
+  }
+  //Otherwise the whole packet has been consumed
+  else
+  {
+    network_packet_release(arg);
   }
   semaphore_V(socket->send_receive_mutex);
   return copy_len;
@@ -471,17 +499,15 @@ int minisocket_receive(minisocket_t *socket, char *msg, int max_len, minisocket_
 static void minisocket_free (minisocket_t * socket) {
   network_interrupt_arg_t *packet = NULL;
   while (queue_dequeue(socket->data, (void **)&packet) != -1) {
-    free(packet);
+    network_packet_release(packet);
   }
-  queue_free(socket->data);
-  socket->data = NULL;
-  semaphore_destroy(socket->data_ready);
-  semaphore_destroy(socket->wait_for_ack);
-  semaphore_destroy(socket->send_receive_mutex);
   semaphore_P(ports_mutex);
   ports[socket->local_port] = NULL;
   semaphore_V(ports_mutex);
-  free(socket);
+  if (socket->socket_type == 'c') {
+    port_allocator_put(client_ports, socket->local_port);
+  }
+  slab_free(socket_cache, socket);
 }
   
 void minisocket_close(minisocket_t *socket)
@@ -499,8 +525,7 @@ void minisocket_close(minisocket_t *socket)
     minisocket_error s_error;
     int wait_val = 100;
     while (wait_val <= 12800) {
-      send_control_message(MSG_FIN, socket->remote_port, socket->remote_addr,
-			   socket->local_port, socket->seq_number, socket->ack_number, &s_error);
+      send_socket_message(socket, MSG_FIN, socket->seq_number, socket->ack_number, &s_error);
       socket->seq_number += 1;
       if (s_error == SOCKET_OUTOFMEMORY) {
 	return;
@@ -531,11 +556,11 @@ void minisocket_handle_tcp_packet(network_interrupt_arg_t *arg)
   mini_header_reliable_t *header = (mini_header_reliable_t *) (arg->buffer);
   int port = unpack_unsigned_short(header->destination_port);
   if (port < MIN_SERVER_PORT || port > MAX_CLIENT_PORT || !ports[port]) {
-    free(arg);
+    network_packet_release(arg);
     return;
   }
   if (ports[port]->socket_state == INITIAL || ports[port]->socket_state == CLOSED) {
-    free(arg);
+    network_packet_release(arg);
     return;
   }
 
@@ -556,21 +581,21 @@ void minisocket_handle_tcp_packet(network_interrupt_arg_t *arg)
       send_control_message(MSG_FIN, sport, saddr, port, 0, 0, &s_error);
     }
 
-    free(arg);
+    network_packet_release(arg);
     return;    
   }
 
   //If the message is of type SYNACK and from the same client
   if (header->message_type - '0' == MSG_SYNACK) {
-    send_control_message(MSG_ACK, sport, saddr, port, 0, 0, &s_error);
-    free(arg);
+    send_socket_message(ports[port], MSG_ACK, 0, 0, &s_error);
+    network_packet_release(arg);
     return;
   }
 
   //If the message is of type FIN
   if (header->message_type - '0' == MSG_FIN) {
     ports[port]->ack_number += 1;
-    send_control_message(MSG_ACK, sport, saddr, port, ports[port]->seq_number, ports[port]->ack_number, &s_error);
+    send_socket_message(ports[port], MSG_ACK, ports[port]->seq_number, ports[port]->ack_number, &s_error);
     ports[port]->socket_state = CLOSING;
     int count = semaphore_get_count(ports[port]->data_ready);
     while (count < 0) {
@@ -579,7 +604,7 @@ void minisocket_handle_tcp_packet(network_interrupt_arg_t *arg)
     }
     register_alarm(15000, (alarm_handler_t) minisocket_close, ports[port]); 
     //minisocket_free(ports[port]);
-    free(arg);
+    network_packet_release(arg);
     return;
   }
 
@@ -595,7 +620,10 @@ void minisocket_handle_tcp_packet(network_interrupt_arg_t *arg)
 	queue_append(ports[port]->data, arg);
 	semaphore_V(ports[port]->data_ready);
         ports[port]->ack_number += packet_size;
-        send_control_message(MSG_ACK, sport, saddr, port, ports[port]->seq_number, ports[port]->ack_number, &s_error);
+        send_socket_message(ports[port], MSG_ACK, ports[port]->seq_number, ports[port]->ack_number, &s_error);
+      }
+      else {
+        network_packet_release(arg);
       }
       if (ports[port]->ack_flag == 0) {
         ports[port]->ack_flag = 1;
@@ -604,8 +632,10 @@ void minisocket_handle_tcp_packet(network_interrupt_arg_t *arg)
       return;
     }
     else {
-      free(arg);
+      network_packet_release(arg);
       return;
     }
   }
+
+  network_packet_release(arg);
 }
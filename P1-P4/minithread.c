@@ -20,6 +20,8 @@
 #include "minimsg.h"
 #include "miniheader.h"
 #include "minisocket.h"
+#include "minirdp.h"
+#include "minirpc.h"
 /*
  * A minithread should be defined either in this file or in a private
  * header file.  Minithreads have a stack pointer with to make procedure
@@ -203,7 +205,7 @@ void network_handler(void *a)
   network_interrupt_arg_t *arg = (network_interrupt_arg_t *) a;
   if (arg->size < sizeof(mini_header_t))
   {
-    free(a);
+    network_packet_release((network_interrupt_arg_t *) a);
     set_interrupt_level(old_level);
     return;
   }
@@ -211,12 +213,21 @@ void network_handler(void *a)
   mini_header_t *header = (mini_header_t *) (arg->buffer);
 
   //Handle UDP Packet
-  if (header->protocol-'0' == PROTOCOL_MINIDATAGRAM) {
+  if (header->protocol-'0' == PROTOCOL_MINIDATAGRAM || header->protocol-'0' == PROTOCOL_MINIFRAGMENT
+      || header->protocol-'0' == PROTOCOL_MINIGROUP) {
     handle_udp_packet(arg);
     set_interrupt_level(old_level);
     return;
   }
   
+  //Handle reliable datagrams
+  else if (header->protocol-'0' == PROTOCOL_MINIRDP)
+  {
+    minirdp_handle_packet(arg);
+    set_interrupt_level(old_level);
+    return;
+  }
+
   //Handle TCP Packet
   else if (header->protocol-'0' == PROTOCOL_MINISTREAM)
   {
@@ -227,7 +238,7 @@ void network_handler(void *a)
     return;
   }
 
-  free(arg);
+  network_packet_release(arg);
   set_interrupt_level(old_level);
   return;  
 }
@@ -251,6 +262,8 @@ minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
   alarm_system_initialize();  
   minimsg_initialize();
   minisocket_initialize();
+  minirdp_initialize();
+  minirpc_initialize();
   reaper_thread = minithread_create(clean_stopped_threads, NULL);
   minithread_fork(mainproc, mainarg);
   interrupt_level_t prev_level = set_interrupt_level(ENABLED);
@@ -386,7 +399,7 @@ clock_handler(void* arg)
   alarm_t *next_alarm = get_next_alarm();
   while (next_alarm) {
     call_handler(next_alarm);
-    // since next_alarm is the first element, deregister also runs in O(1)
+    // next_alarm is the root of the alarm heap, so deregister runs in O(log n)
     deregister_alarm(next_alarm);
     next_alarm = get_next_alarm();
   }
@@ -0,0 +1,183 @@
+/* MPSC queue test
+
+     stress the wait-free multi-producer, single-consumer queue of queue.h
+     from plain pthreads, and measure its throughput.
+
+     producers push numbered items, one at a time or in batches, while the
+     consumer pops them and checks that every producer's items come out
+     complete and in order. whenever the queue is empty the consumer sleeps
+     until the doorbell wakes it, so a lost wakeup shows up as a stall.
+     then every producer pushes as fast as it can, one item at a time, and
+     the rate at which the consumer gets them is printed.
+
+     USAGE: ./mpsc-test [<producers> [<items>]]
+
+     producers = number of producer threads (default 4).
+     items     = items each producer pushes in each phase (default 1000000).
+
+     to check the queue for data races, build everything with the thread
+     sanitizer (after removing the *.o files of a normal build):
+
+     make mpsc-test CFLAGS="-fsanitize=thread -g -O1 -I. -std=gnu99" \
+         LFLAGS="-fsanitize=thread -lrt -lm -pthread -g -no-pie"
+*/
+
+#include "defs.h"
+#include "queue.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#define MAX_PRODUCERS 64
+#define BATCH_SIZE 16
+#define STALL_SECONDS 5
+
+typedef struct {
+    int producer;
+    int seq;
+    mpsc_node_t node;
+} item_t;
+
+mpsc_queue_t* queue;
+sem_t doorbell;
+int producers = 4;
+int items = 1000000;
+int batching;
+int pacing;
+item_t* pool[MAX_PRODUCERS];
+long long int rings;
+
+void
+ring(void* arg) {
+    __atomic_add_fetch(&rings, 1, __ATOMIC_RELAXED);
+    sem_post(&doorbell);
+}
+
+void*
+produce(void* arg) {
+    int p = (int) (long) arg;
+    mpsc_node_t* batch[BATCH_SIZE];
+    int i, n = 0;
+
+    for (i=0; i<items; i++) {
+        pool[p][i].producer = p;
+        pool[p][i].seq = i;
+        /* let the consumer catch up now and then, so that it goes to sleep */
+        if (pacing && i % 32 == 0)
+            sched_yield();
+        if (!batching) {
+            mpsc_queue_push(queue, &pool[p][i].node);
+            continue;
+        }
+        /* batches of any length from 1 to BATCH_SIZE */
+        batch[n++] = &pool[p][i].node;
+        if (n == BATCH_SIZE || (i * 7919) % 13 == 0) {
+            mpsc_queue_push_batch(queue, batch, n);
+            n = 0;
+        }
+    }
+    if (n > 0)
+        mpsc_queue_push_batch(queue, batch, n);
+
+    return NULL;
+}
+
+double
+seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * run one phase. in a stress phase the producers pause now and then, and the
+ * consumer sleeps until the doorbell rings whenever the queue is empty.
+ */
+double
+run(int stress) {
+    pthread_t threads[MAX_PRODUCERS];
+    int next[MAX_PRODUCERS];
+    long long int total = (long long int) producers * items, got = 0;
+    struct timespec deadline;
+    mpsc_node_t* node;
+    item_t* item;
+    double start;
+    int i;
+
+    pacing = stress;
+    queue = mpsc_queue_new(ring, NULL);
+    AbortOnCondition(queue == NULL, "Could not create the queue.");
+    for (i=0; i<producers; i++)
+        next[i] = 0;
+
+    start = seconds();
+    for (i=0; i<producers; i++)
+        AbortOnCondition(pthread_create(&threads[i], NULL, produce, (void*) (long) i) != 0,
+                         "Could not start a producer.");
+
+    while (got < total) {
+        if (mpsc_queue_pop(queue, &node) == -1) {
+            if (stress) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += STALL_SECONDS;
+                AbortOnCondition(sem_timedwait(&doorbell, &deadline) != 0,
+                                 "Stalled: the doorbell was not rung.");
+            }
+            continue;
+        }
+        item = mpsc_entry(node, item_t, node);
+        AbortOnCondition(item->producer < 0 || item->producer >= producers
+                         || item->seq != next[item->producer],
+                         "Items out of order, lost or repeated.");
+        next[item->producer]++;
+        got++;
+    }
+
+    for (i=0; i<producers; i++)
+        pthread_join(threads[i], NULL);
+    AbortOnCondition(mpsc_queue_pop(queue, &node) != -1, "Items left over.");
+    AbortOnCondition(mpsc_queue_free(queue) != 0, "Could not free the queue.");
+    while (sem_trywait(&doorbell) == 0)
+        ;
+
+    return total / (seconds() - start);
+}
+
+int
+main(int argc, char** argv) {
+    int i;
+
+    if (argc > 1)
+        producers = atoi(argv[1]);
+    if (argc > 2)
+        items = atoi(argv[2]);
+    AbortOnCondition(producers < 1 || producers > MAX_PRODUCERS || items < 1,
+                     "USAGE: ./mpsc-test [<producers> [<items>]]");
+
+    sem_init(&doorbell, 0, 0);
+    for (i=0; i<producers; i++) {
+        pool[i] = (item_t *) malloc(items * sizeof(item_t));
+        AbortOnCondition(pool[i] == NULL, "Out of memory.");
+    }
+
+    rings = 0;
+    batching = 0;
+    run(1);
+    printf("Single pushes, sleeping consumer: %d x %d items in order, %lld doorbells.\n",
+           producers, items, rings);
+
+    rings = 0;
+    batching = 1;
+    run(1);
+    printf("Batched pushes, sleeping consumer: %d x %d items in order, %lld doorbells.\n",
+           producers, items, rings);
+
+    batching = 0;
+    printf("Throughput: %.1f million items/s.\n", run(0) / 1e6);
+
+    return 0;
+}
@@ -3,11 +3,22 @@
  *      This module paints the unix socket interface a pretty color.
  */
 
+#define _GNU_SOURCE             /* for recvmmsg */
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -20,6 +31,9 @@
 #include "interrupts_private.h"
 #include "minithread.h"
 #include "random.h"
+#include "queue.h"
+#include "heap.h"
+#include "capture.h"
 
 #define BCAST_ENABLED 0
 #define BCAST_USE_TOPOLOGY_FILE 0
@@ -35,6 +49,65 @@
 
 #define NETWORK_INTERRUPT_TYPE 2
 
+/* receive packet pool: small packets (ACKs, control messages, short
+ * datagrams) are copied out of the receive buffer into a small buffer so
+ * that they do not pin a full MAX_NETWORK_PKT_SIZE buffer */
+#define PACKET_SMALL_SIZE 512
+#define PACKET_SMALL_COUNT 1024
+#define PACKET_LARGE_COUNT 256
+#define PACKET_ALIGN 16
+
+/* maximum number of datagrams taken off the socket per recvmmsg call */
+#define NETWORK_RECV_BATCH 32
+
+/* most sockets, each with its poll thread, that can share the UDP port */
+#define NETWORK_MAX_RECV_SOCKETS 16
+
+/* maximum number of packets queued on a batch before it is flushed */
+#define NETWORK_SEND_BATCH 32
+
+/* UDP segmentation offload, in case the C library headers predate it */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/*
+ * Shared-memory transport between PortOS processes on this host. Every
+ * process publishes an inbox, named after its UDP port, holding one SPSC
+ * ring per sending process.
+ */
+#define SHM_ENABLED 1
+#define SHM_NAME_FORMAT "/portos-%d"
+#define SHM_MAGIC 0x504f5348
+#define SHM_MAX_RINGS 8
+#define SHM_RING_BYTES (256 * 1024)
+#define SHM_RECORD_ALIGN 64
+#define SHM_MAX_PEERS 16
+#define SHM_RETRY_MS 1000
+
+/*
+ * most destinations that faults and emulation keep state for, and the
+ * buckets of the hash table that finds them
+ */
+#define NETWORK_MAX_LINKS 65536
+#define LINK_BUCKETS 256
+
+/*
+ * fault schedule files start with this, followed by the seed; each record
+ * is a kind and a 16-bit link id, and delays have their value after them
+ */
+#define FAULT_MAGIC 0x32534650
+
+/* largest UDP payload, and most segments the kernel accepts per GSO send */
+#define UDP_MAX_PAYLOAD 65507
+#define GSO_MAX_SEGMENTS 64
+
 /*******************************************************************************
 *  Private types and functions                                                 *
 *******************************************************************************/
@@ -62,18 +135,237 @@ double loss_rate = 0.0;
 double duplication_rate = 0.0;
 bool synthetic_network = false;
 
+/* -1 until the first GSO send tells us whether the kernel supports it */
+static int gso_supported = -1;
+static bool gro_enabled = false;
+static int recv_sockets = 1;
+
 
 struct address_info {
   int sock;
   struct sockaddr_in sin;
-  char pkt[MAX_NETWORK_PKT_SIZE];
 };
 
 struct address_info if_info;
 static network_address_t broadcast_addr = { 0 };
 
+/*
+ * A pooled packet. The interrupt argument comes first so that the pointer
+ * handed to the interrupt handler is the packet itself. Free packets sit on
+ * the MPSC free list of their size class: any thread may push a packet back,
+ * only the owning poll thread pops.
+ */
+typedef struct {
+  network_interrupt_arg_t arg;
+  int refcount;
+  mpsc_queue_t *free_list;
+  mpsc_node_t node;
+  char data[];
+} packet_t;
+
+typedef struct {
+  char *small_region;
+  char *large_region;
+  mpsc_queue_t *small_free;
+  mpsc_queue_t *large_free;
+  long long int dropped;
+} packet_pool_t;
+
+/* 
+ * state of a network poll thread. Received packets are handed to the
+ * minithreads through the ready queue; its doorbell raises the network
+ * interrupt, so there is one interrupt per burst rather than per packet.
+ */
+typedef struct {
+  int (*poll)(void*);
+  int sock;
+  packet_pool_t pool;
+  mpsc_queue_t *ready;
+  char *gro_buffer;
+} poll_thread_t;
+
+static poll_thread_t poll_threads[NETWORK_MAX_RECV_SOCKETS];
+static network_handler_t user_network_handler;
+
+/*
+ * An outgoing batch. Packets are copied into their own slots when they are
+ * queued, so the caller's buffers may be reused straight away.
+ */
+struct network_batch {
+  int count;
+  network_address_t dest[NETWORK_SEND_BATCH];
+  int size[NETWORK_SEND_BATCH];
+  int flags[NETWORK_SEND_BATCH];      /* capture annotations */
+  char* data[NETWORK_SEND_BATCH];
+};
+
+/*
+ * In-process loopback. Packets sent to our own address are copied into a
+ * pool of their own and run through the user's handler straight away,
+ * without a trip through the kernel, the poll thread and a signal. All of
+ * this is only touched by minithreads, with interrupts disabled.
+ */
+typedef struct {
+  packet_pool_t pool;
+  mpsc_queue_t *ready;
+  int draining;
+  network_address_t address;
+} loopback_t;
+
+static loopback_t loopback;
+
+/*
+ * A ring of variable-length records in shared memory, written only by the
+ * process whose pid is in owner and read only by the owner of the inbox.
+ * head and tail are byte counters that wrap; a record with a negative size
+ * pads out the end of the ring.
+ */
+typedef struct {
+  int size;
+  network_address_t sender;
+  int pad;
+} shm_record_t;
+
+typedef struct {
+  int owner;
+  unsigned int head __attribute__((aligned(64)));
+  unsigned int tail __attribute__((aligned(64)));
+  char data[SHM_RING_BYTES] __attribute__((aligned(64)));
+} shm_ring_t;
+
+/*
+ * The inbox of one process. doorbell is a futex word that senders bump and
+ * wake when the receiver has said it is about to sleep by setting waiting.
+ * closed is set when the inbox is abandoned, telling senders to look again.
+ */
+typedef struct {
+  unsigned int magic;
+  int pid;
+  int closed;
+  int waiting;
+  int doorbell;
+  shm_ring_t rings[SHM_MAX_RINGS];
+} shm_inbox_t;
+
+/* an inbox of another process we send to, and our ring in it */
+typedef struct {
+  unsigned int port;
+  shm_inbox_t *inbox;
+  shm_ring_t *ring;
+  uint64_t retry_at;
+} shm_peer_t;
+
+typedef struct {
+  shm_inbox_t *inbox;
+  char name[32];
+  shm_peer_t peers[SHM_MAX_PEERS];
+  int n_peers;
+  long long int dropped;
+  /* rings of our inbox that held garbage, and are no longer read */
+  char ring_closed[SHM_MAX_RINGS];
+} shm_transport_t;
+
+static shm_transport_t shm;
+static poll_thread_t shm_thread;
+
+/*
+ * The network emulator. Every emulated packet is copied, its fate (loss,
+ * duplication, delay) decided at send time by the sending minithread, and
+ * put on a heap ordered by delivery time. The emulator thread sends it
+ * through the socket when its time comes.
+ */
+/*
+ * State kept per destination. Every random fault decision for packets to a
+ * destination is drawn from its own generator, so that the faults on one
+ * link do not depend on the traffic on the others. The emulator fields
+ * are protected by the emulator mutex; the rest is only touched by
+ * minithreads with interrupts disabled.
+ */
+typedef struct fault_stream fault_stream_t;
+
+typedef struct network_link {
+  network_address_t dest;
+  int id;                       /* order of first use, from 0 */
+  struct network_link *hash_next;
+  unsigned long long int rng;
+  fault_stream_t *replay;       /* logged decisions, when replaying */
+  int recorded;                 /* defined in the record file yet? */
+  int bad;                      /* Gilbert-Elliott state */
+  long long int busy_until;     /* end of the last transmission, in us */
+  int queued;                   /* packets of this link in the emulator */
+} network_link_t;
+
+/* allocated one by one, since emulated packets point to their link */
+static network_link_t **links;
+static int n_links = 0;
+static int max_links = 0;
+static network_link_t *link_buckets[LINK_BUCKETS];
+
+/* the kinds of fault decisions, as they appear in schedule files */
+enum { FAULT_LINK = 0, FAULT_LOSS, FAULT_DUPLICATE, FAULT_EMU_LOSS,
+       FAULT_EMU_DUPLICATE, FAULT_EMU_REORDER, FAULT_EMU_DELAY };
+
+enum { FAULT_LIVE = 0, FAULT_RECORD, FAULT_REPLAY };
+
+typedef struct {
+  unsigned char kind;
+  int value;
+} fault_decision_t;
+
+/* the decisions logged for one destination, consumed in order on replay */
+struct fault_stream {
+  network_address_t dest;
+  fault_decision_t *decisions;
+  int count;
+  int capacity;
+  int next;
+};
+
+typedef struct {
+  unsigned int seed;
+  int mode;
+  FILE *file;
+  fault_stream_t *streams;
+  int n_streams;
+  long long int desyncs;
+} fault_schedule_t;
+
+static fault_schedule_t faults = { 4357 };
+
+typedef struct {
+  heap_node_t node;
+  network_link_t *link;
+  int size;
+  int flags;                          /* capture annotations */
+  char data[];
+} emulator_packet_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  int enabled;
+  int started;
+  network_emulator_params_t params;
+  network_emulator_stats_t stats;
+  heap_t *heap;
+} emulator_t;
+
+static emulator_t emulator = { PTHREAD_MUTEX_INITIALIZER };
+static int emulator_send(const network_address_t, const struct iovec*, int, int);
+static int synthetic_copies(const network_address_t);
+
+/*
+ * Packets sent by the network interrupt handler are queued on this batch
+ * and flushed once the whole interrupt batch has been handled.
+ */
+static network_batch_t *interrupt_batch;
+static int in_interrupt_batch = 0;
+
 /* forward definition */
-void start_network_poll(interrupt_handler_t, int*);
+void start_network_poll(interrupt_handler_t, poll_thread_t*);
+static int loopback_send(const struct iovec*, int, int);
+static void capture_send(const network_address_t, int, const struct iovec*, int, int);
+static int shm_send(const network_address_t, const struct iovec*, int, int);
 void network_address_to_sockaddr(const network_address_t addr, struct sockaddr_in* sin);
 void sockaddr_to_network_address(const struct sockaddr_in* sin, network_address_t addr);
 
@@ -102,61 +394,409 @@ network_printaddr(network_address_t addr) {
   printf("%s", name);
 }
 
+/*
+ * Send the parts of a packet as one datagram, gathered by the kernel
+ * straight from the caller's memory. Nothing is copied or shared here, so
+ * concurrent senders do not interfere.
+ */
 static int
-send_pkt(const network_address_t dest_address,
-         int hdr_len, const char* hdr,
-         int data_len, const char* data) {
-  int cc;
+send_pktv(const network_address_t dest_address,
+          const struct iovec* iov, int iovcnt, int flags) {
   struct sockaddr_in sin;
-  char* bufp;
-  int sz, pktlen;
-  
-  pktlen = hdr_len + data_len;
-  
+  struct msghdr msg;
+  int i, pktlen;
+
   /* sanity checks */
-  if (hdr_len < 0 || data_len < 0 || pktlen > MAX_NETWORK_PKT_SIZE)
+  if (iovcnt < 0 || iovcnt > NETWORK_MAX_IOVEC || (iovcnt > 0 && iov == NULL))
     return 0;
-  
-  /*
-   * Pull up the headers and data and stuff them into the output
-   * packet with the
-   * field sizes embedded.
-   */
-  
-  bufp = if_info.pkt;
-  
-  sz = hdr_len;
-  memcpy(bufp, hdr, sz);
-  bufp += sz;
-  
-  sz = data_len;
-  memcpy(bufp, data, sz);
-  bufp += sz;
-  
+
+  pktlen = 0;
+  for (i=0; i<iovcnt; i++) {
+    if ((int) iov[i].iov_len < 0)
+      return 0;
+    pktlen += iov[i].iov_len;
+  }
+  if (pktlen > MAX_NETWORK_PKT_SIZE)
+    return 0;
+
+  if (emulator.enabled && (i = emulator_send(dest_address, iov, iovcnt, pktlen)) != -1)
+    return i;
+
+  capture_send(dest_address, flags, iov, iovcnt, pktlen);
+
+  if (network_address_is_local(dest_address))
+    return loopback_send(iov, iovcnt, pktlen);
+
+  if (SHM_ENABLED && (i = shm_send(dest_address, iov, iovcnt, pktlen)) != -1)
+    return i;
+
   network_address_to_sockaddr(dest_address, &sin);
-  cc = sendto(if_info.sock,
-              if_info.pkt,
-              pktlen,
-              0,
-              (struct sockaddr *) &sin,
-              sizeof(sin));
-  
-  return cc;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &sin;
+  msg.msg_namelen = sizeof(sin);
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+
+  return sendmsg(if_info.sock, &msg, 0);
+}
+
+static int
+send_pkt(const network_address_t dest_address,
+         int hdr_len, const char* hdr,
+         int data_len, const char* data, int flags) {
+  struct iovec iov[2];
+
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
+
+  iov[0].iov_base = (char *) hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = (char *) data;
+  iov[1].iov_len = data_len;
+
+  return send_pktv(dest_address, iov, 2, flags);
 }
 
 int 
 network_send_pkt(const network_address_t dest_address, int hdr_len, 
                  const char* hdr, int data_len, const char* data) {
 
+  if (in_interrupt_batch)
+    return network_batch_add(interrupt_batch, dest_address, hdr_len, hdr,
+                             data_len, data);
+
   if (synthetic_network) {
-    if(genrand() < loss_rate)
+    int copies = synthetic_copies(dest_address);
+    if (copies == 0) {
+      if (capture_active) {
+        struct iovec iov[2] = { { (char *) hdr, hdr_len }, { (char *) data, data_len } };
+        capture_send(dest_address, CAPTURE_DROPPED, iov, 2, hdr_len + data_len);
+      }
       return (hdr_len+data_len);
+    }
+
+    if (copies == 2)
+      send_pkt(dest_address, hdr_len, hdr, data_len, data, CAPTURE_DUPLICATE);
+  }
+
+  return send_pkt(dest_address, hdr_len, hdr, data_len, data, 0);
+}
+
+int
+network_send_pktv(const network_address_t dest_address,
+                  const struct iovec* iov, int iovcnt) {
+
+  if (in_interrupt_batch)
+    return network_batch_addv(interrupt_batch, dest_address, iov, iovcnt);
+
+  if (synthetic_network) {
+    int copies = synthetic_copies(dest_address);
+    if (copies == 0) {
+      int i, len = 0;
+      for (i=0; i<iovcnt; i++)
+        len += iov[i].iov_len;
+      capture_send(dest_address, CAPTURE_DROPPED, iov, iovcnt, len);
+      return len;
+    }
+
+    if (copies == 2)
+      send_pktv(dest_address, iov, iovcnt, CAPTURE_DUPLICATE);
+  }
+
+  return send_pktv(dest_address, iov, iovcnt, 0);
+}
+
+/*
+ * Send the segments starting at segment first, n of them, as one GSO
+ * super-packet. Every segment is a header followed by seg_len bytes of
+ * data, except that the last one may be shorter.
+ */
+static int
+send_gso(const network_address_t dest_address, int hdr_len, const char* hdrs,
+         int seg_len, int data_len, const char* data, int first, int n) {
+  struct iovec iov[2 * GSO_MAX_SEGMENTS];
+  struct sockaddr_in sin;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  int i, offset, len;
+
+  for (i=0; i<n; i++) {
+    offset = (first + i) * seg_len;
+    len = (data_len - offset < seg_len) ? data_len - offset : seg_len;
+    iov[2*i].iov_base = (char *) hdrs + (first + i) * hdr_len;
+    iov[2*i].iov_len = hdr_len;
+    iov[2*i+1].iov_base = (char *) data + offset;
+    iov[2*i+1].iov_len = len;
+    capture_send(dest_address, 0, &iov[2*i], 2, hdr_len + len);
+  }
+
+  network_address_to_sockaddr(dest_address, &sin);
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_name = &sin;
+  msg.msg_namelen = sizeof(sin);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2 * n;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  *((uint16_t *) CMSG_DATA(cmsg)) = hdr_len + seg_len;
+
+  return sendmsg(if_info.sock, &msg, 0);
+}
+
+int
+network_send_segments(const network_address_t dest_address,
+                      int hdr_len, const char* hdrs,
+                      int seg_len, int data_len, const char* data) {
+  struct iovec iov[2];
+  int n_segs, per_send, first, n, i, offset, len;
+  int sent = 0;
+
+  /* sanity checks */
+  if (hdr_len < 0 || seg_len <= 0 || data_len <= 0 || hdrs == NULL
+      || data == NULL || hdr_len + seg_len > MAX_NETWORK_PKT_SIZE)
+    return -1;
+
+  n_segs = (data_len + seg_len - 1) / seg_len;
+  per_send = UDP_MAX_PAYLOAD / (hdr_len + seg_len);
+  if (per_send > GSO_MAX_SEGMENTS)
+    per_send = GSO_MAX_SEGMENTS;
+
+  for (first=0; first<n_segs; first+=n) {
+    n = (n_segs - first < per_send) ? n_segs - first : per_send;
+
+    /*
+     * Segments go out one by one where the kernel lacks GSO, and also when
+     * the synthetic network or the emulator must see each of them,
+     * when they are batched by the network interrupt handler or when they
+     * do not go through the kernel.
+     */
+    if (n > 1 && gso_supported != 0 && !synthetic_network && !in_interrupt_batch
+        && !emulator.enabled
+        && !network_address_is_local(dest_address)
+        && !(SHM_ENABLED && network_address_is_colocated(dest_address))) {
+      int cc = send_gso(dest_address, hdr_len, hdrs, seg_len, data_len, data,
+                        first, n);
+      if (cc >= 0) {
+        gso_supported = 1;
+        sent += cc;
+        continue;
+      }
+      if (gso_supported == 1 || (errno != EIO && errno != EINVAL
+                                 && errno != ENOPROTOOPT && errno != EOPNOTSUPP))
+        return (sent == 0) ? -1 : sent;
+      gso_supported = 0;
+    }
+
+    for (i=first; i<first+n; i++) {
+      offset = i * seg_len;
+      len = (data_len - offset < seg_len) ? data_len - offset : seg_len;
+      iov[0].iov_base = (char *) hdrs + i * hdr_len;
+      iov[0].iov_len = hdr_len;
+      iov[1].iov_base = (char *) data + offset;
+      iov[1].iov_len = len;
+      if (network_send_pktv(dest_address, iov, 2) != hdr_len + len)
+        return (sent == 0) ? -1 : sent;
+      sent += hdr_len + len;
+    }
+  }
+
+  return sent;
+}
+
+network_batch_t*
+network_batch_new() {
+  network_batch_t* batch;
+  char* region;
+  int i;
+
+  batch = (network_batch_t *) malloc(sizeof(network_batch_t));
+  region = (char *) malloc(NETWORK_SEND_BATCH * MAX_NETWORK_PKT_SIZE);
+  if (batch == NULL || region == NULL) {
+    free(batch);
+    free(region);
+    return NULL;
+  }
+
+  batch->count = 0;
+  for (i=0; i<NETWORK_SEND_BATCH; i++)
+    batch->data[i] = region + i * MAX_NETWORK_PKT_SIZE;
+
+  return batch;
+}
+
+/* copy one packet into the next free slot, flushing first if there is none */
+static int
+batch_queue(network_batch_t* batch, const network_address_t dest_address,
+            const struct iovec* iov, int iovcnt, int pktlen, int flags) {
+  char* bufp;
+  int i;
+
+  if (batch->count == NETWORK_SEND_BATCH && network_send_batch(batch) == -1)
+    return -1;
+
+  bufp = batch->data[batch->count];
+  for (i=0; i<iovcnt; i++) {
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  network_address_copy(dest_address, batch->dest[batch->count]);
+  batch->size[batch->count] = pktlen;
+  batch->flags[batch->count] = flags;
+  batch->count++;
+
+  return pktlen;
+}
+
+int
+network_batch_addv(network_batch_t* batch, const network_address_t dest_address,
+                   const struct iovec* iov, int iovcnt) {
+  int i, pktlen;
+
+  /* sanity checks */
+  if (batch == NULL || iovcnt < 0 || iovcnt > NETWORK_MAX_IOVEC
+      || (iovcnt > 0 && iov == NULL))
+    return 0;
+
+  pktlen = 0;
+  for (i=0; i<iovcnt; i++) {
+    if ((int) iov[i].iov_len < 0)
+      return 0;
+    pktlen += iov[i].iov_len;
+  }
+  if (pktlen > MAX_NETWORK_PKT_SIZE)
+    return 0;
+
+  if (synthetic_network) {
+    int copies = synthetic_copies(dest_address);
+    if (copies == 0) {
+      capture_send(dest_address, CAPTURE_DROPPED, iov, iovcnt, pktlen);
+      return pktlen;
+    }
+
+    if (copies == 2
+       && batch_queue(batch, dest_address, iov, iovcnt, pktlen,
+                      CAPTURE_DUPLICATE) == -1)
+      return -1;
+  }
+
+  return batch_queue(batch, dest_address, iov, iovcnt, pktlen, 0);
+}
+
+int
+network_batch_add(network_batch_t* batch, const network_address_t dest_address,
+                  int hdr_len, const char* hdr, int data_len, const char* data) {
+  struct iovec iov[2];
+
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
+
+  iov[0].iov_base = (char *) hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = (char *) data;
+  iov[1].iov_len = data_len;
+
+  return network_batch_addv(batch, dest_address, iov, 2);
+}
+
+/*
+ * Hand the whole batch to the kernel with sendmmsg, which may take fewer
+ * packets than offered per call.
+ */
+int
+network_send_batch(network_batch_t* batch) {
+  struct mmsghdr msgs[NETWORK_SEND_BATCH];
+  struct iovec iovecs[NETWORK_SEND_BATCH];
+  struct sockaddr_in sins[NETWORK_SEND_BATCH];
+  int i, n, n_msgs, sent;
+
+  if (batch == NULL)
+    return -1;
+
+  n_msgs = 0;
+  sent = 0;
+  memset(msgs, 0, batch->count * sizeof(struct mmsghdr));
+  for (i=0; i<batch->count; i++) {
+    iovecs[n_msgs].iov_base = batch->data[i];
+    iovecs[n_msgs].iov_len = batch->size[i];
+
+    if (emulator.enabled
+        && emulator_send(batch->dest[i], &iovecs[n_msgs], 1, batch->size[i]) != -1) {
+      sent++;
+      continue;
+    }
+
+    capture_send(batch->dest[i], batch->flags[i], &iovecs[n_msgs], 1, batch->size[i]);
+
+    /* packets to ourselves and to our neighbours do not need the kernel */
+    if (network_address_is_local(batch->dest[i])) {
+      loopback_send(&iovecs[n_msgs], 1, batch->size[i]);
+      sent++;
+      continue;
+    }
+    if (SHM_ENABLED && shm_send(batch->dest[i], &iovecs[n_msgs], 1, batch->size[i]) != -1) {
+      sent++;
+      continue;
+    }
 
-    if(genrand() < duplication_rate)
-      send_pkt(dest_address, hdr_len, hdr, data_len, data);
+    network_address_to_sockaddr(batch->dest[i], &sins[n_msgs]);
+    msgs[n_msgs].msg_hdr.msg_name = &sins[n_msgs];
+    msgs[n_msgs].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[n_msgs].msg_hdr.msg_iov = &iovecs[n_msgs];
+    msgs[n_msgs].msg_hdr.msg_iovlen = 1;
+    n_msgs++;
   }
+  batch->count = 0;
 
-  return send_pkt(dest_address, hdr_len, hdr, data_len, data);
+  for (i=0; i<n_msgs; i+=n) {
+    n = sendmmsg(if_info.sock, msgs + i, n_msgs - i, 0);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      /* the rest of the batch is lost, as a failed sendto would be */
+      return -1;
+    }
+    sent += n;
+  }
+
+  return sent;
+}
+
+int
+network_batch_length(network_batch_t* batch) {
+  return (batch == NULL) ? 0 : batch->count;
+}
+
+void
+network_batch_free(network_batch_t* batch) {
+  if (batch == NULL)
+    return;
+  free(batch->data[0]);
+  free(batch);
+}
+
+int
+network_address_is_local(const network_address_t address) {
+  if (address[1] != loopback.address[1] || loopback.ready == NULL)
+    return 0;
+
+  return (address[0] == loopback.address[0] || (ntohl(address[0]) >> 24) == 127);
+}
+
+int
+network_address_is_colocated(const network_address_t address) {
+  if (loopback.ready == NULL || address[1] == loopback.address[1])
+    return 0;
+
+  return (address[0] == loopback.address[0] || (ntohl(address[0]) >> 24) == 127);
 }
 
 void
@@ -245,6 +885,20 @@ network_udp_ports(short myportnum, short otherportnum) {
   other_udp_port = otherportnum;
 }
 
+void
+network_set_gro(int enabled) {
+  gro_enabled = enabled ? true : false;
+}
+
+void
+network_set_receive_sockets(int k) {
+  if (k < 1)
+    k = 1;
+  if (k > NETWORK_MAX_RECV_SOCKETS)
+    k = NETWORK_MAX_RECV_SOCKETS;
+  recv_sockets = k;
+}
+
 void
 network_synthetic_params(double loss, double duplication) {
   synthetic_network = true;
@@ -371,42 +1025,64 @@ network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data) {
                    "Error: network broadcast not enabled.");
   
   if (BCAST_USE_TOPOLOGY_FILE){
+    static network_batch_t* bcast_batch = NULL;
+    network_batch_t* batch;
+    interrupt_level_t old_level;
+    int result = hdr_len + data_len;
+
+    /* the fan-out to all the neighbours leaves in one sendmmsg */
+    old_level = set_interrupt_level(DISABLED);
+    if (in_interrupt_batch)
+      batch = interrupt_batch;
+    else {
+      if (bcast_batch == NULL)
+        bcast_batch = network_batch_new();
+      batch = bcast_batch;
+    }
+    if (batch == NULL) {
+      set_interrupt_level(old_level);
+      return -1;
+    }
 
     me = topology.me;
     
     for (i=0; i<topology.entries[me].n_links; i++) {
       int dest = topology.entries[me].links[i];
       
-      if (synthetic_network) {
-        if(genrand() < loss_rate)
-          continue;
-        
-        if(genrand() < duplication_rate)
-          send_pkt(topology.entries[dest].addr, hdr_len, hdr, data_len, data);
-      }
-      
-      if (send_pkt(topology.entries[dest].addr, 
-                   hdr_len, hdr, data_len, data) != hdr_len + data_len)
-        return -1;
+      if (network_batch_add(batch, topology.entries[dest].addr,
+                            hdr_len, hdr, data_len, data) != hdr_len + data_len)
+        result = -1;
     }
 
     if (BCAST_LOOPBACK) {
+      /* the loopback copy is not subject to synthetic loss */
       if (send_pkt(topology.entries[me].addr, 
-                   hdr_len, hdr, data_len, data) != hdr_len + data_len)
-        return -1;
+                   hdr_len, hdr, data_len, data, 0) != hdr_len + data_len)
+        result = -1;
     }
+
+    if (batch != interrupt_batch && network_send_batch(batch) == -1)
+      result = -1;
+    set_interrupt_level(old_level);
+
+    return result;
   
   } else { /* real broadcast */
 
     /* send the packet using the private network broadcast address */
     if (send_pkt(broadcast_addr, 
-                 hdr_len, hdr, data_len, data) != hdr_len + data_len)
+                 hdr_len, hdr, data_len, data, 0) != hdr_len + data_len)
       return -1;
 
   }
   return hdr_len+data_len;
 }
 
+int
+network_bcast_enabled() {
+  return BCAST_ENABLED;
+}
+
 void
 network_add_bcast_link(char* src, char* dest) {
   bcast_add_link(&topology, src, dest);
@@ -418,52 +1094,1318 @@ network_remove_bcast_link(char* src, char* dest) {
 }
 
 
-int network_poll(void* arg) {
-  int* s;
-  network_interrupt_arg_t* packet;
-  struct sockaddr_in addr;
-  unsigned int fromlen = sizeof(struct sockaddr_in);
+/* capture taps: we are the source of what we send, the destination of what we receive */
+static void
+capture_send(const network_address_t dest_address, int flags,
+             const struct iovec* iov, int iovcnt, int pktlen) {
+  if (capture_active)
+    capture_packet(CAPTURE_OUT, flags, loopback.address, dest_address,
+                   iov, iovcnt, pktlen);
+}
 
-  s = (int *) arg;
+static void
+capture_receive(packet_t* packet) {
+  if (capture_active) {
+    struct iovec iov = { packet->data, packet->arg.size };
+    capture_packet(CAPTURE_IN, 0, packet->arg.sender, loopback.address,
+                   &iov, 1, packet->arg.size);
+  }
+}
 
-  while(true) {
+/*
+ * Carve count packets with room for capacity bytes of data out of one
+ * region and put them all on a new free list.
+ */
+static char*
+packet_pool_fill(mpsc_queue_t** free_list, int count, int capacity) {
+  size_t slot = (sizeof(packet_t) + capacity + PACKET_ALIGN - 1) & ~(PACKET_ALIGN - 1);
+  char* region = (char *) malloc(slot * count);
+  int i;
 
-    /* we rely on run_user_handler to destroy this data structure */
-    if (DEBUG)
-      kprintf("NET:Allocating an incoming packet.\n");
+  *free_list = mpsc_queue_new(NULL, NULL);
+  if (region == NULL || *free_list == NULL)
+    return NULL;
 
-    packet = 
-      (network_interrupt_arg_t *) malloc(sizeof(network_interrupt_arg_t));
-    assert(packet != NULL);
-  
-    packet->size = recvfrom(*s, packet->buffer, MAX_NETWORK_PKT_SIZE,
-                            0, (struct sockaddr *) &addr, &fromlen);
-    if (packet->size <= 0) {
-      kprintf("NET:Error, %d.\n", errno);
-      AbortOnCondition(1,"Crashing.");
-    }
-    else if (DEBUG)
-      kprintf("NET:Received a packet, seqno %d.\n", ntohl(*((int *) packet->buffer)));
-   
-    assert(fromlen == sizeof(struct sockaddr_in));
-    sockaddr_to_network_address(&addr, packet->sender);
+  for (i=0; i<count; i++) {
+    packet_t* packet = (packet_t *) (region + i * slot);
+    packet->arg.buffer = packet->data;
+    packet->refcount = 0;
+    packet->free_list = *free_list;
+    mpsc_queue_push(*free_list, &packet->node);
+  }
+  return region;
+}
 
-    /* 
-     * now we have filled in the arg to the network interrupt service routine,
-     * so we have to get the user's thread to run it.
-     */
-    if (DEBUG)
-      kprintf("NET:packet arrived.\n");
-    send_interrupt(NETWORK_INTERRUPT_TYPE, mini_network_handler, (void*)packet);
-  }     
+static int
+packet_pool_initialize(packet_pool_t* pool) {
+  pool->dropped = 0;
+  pool->small_region = 
+    packet_pool_fill(&pool->small_free, PACKET_SMALL_COUNT, PACKET_SMALL_SIZE);
+  pool->large_region = 
+    packet_pool_fill(&pool->large_free, PACKET_LARGE_COUNT, MAX_NETWORK_PKT_SIZE);
+  return (pool->small_region && pool->large_region) ? 0 : -1;
 }
 
-/* 
- * start polling for network packets. this is separate so that clock interrupts
- * can be turned on without network interrupts. however, this function requires
+/* take a packet off a free list; only called by the owner of the pool */
+static packet_t*
+packet_pool_get(mpsc_queue_t* free_list) {
+  mpsc_node_t* node;
+
+  if (mpsc_queue_pop(free_list, &node) == -1)
+    return NULL;
+
+  packet_t* packet = mpsc_entry(node, packet_t, node);
+  packet->refcount = 1;
+  return packet;
+}
+
+void
+network_packet_hold(network_interrupt_arg_t* arg) {
+  packet_t* packet = (packet_t *) arg;
+  __atomic_add_fetch(&packet->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void
+network_packet_release(network_interrupt_arg_t* arg) {
+  packet_t* packet = (packet_t *) arg;
+
+  if (packet == NULL)
+    return;
+
+  assert(packet->refcount > 0);
+  if (__atomic_sub_fetch(&packet->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    packet->arg.buffer = packet->data;
+    mpsc_queue_push(packet->free_list, &packet->node);
+  }
+}
+
+/* monotonic time in microseconds */
+static long long int
+emulator_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long int) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Fault decisions. Each link has its own xorshift64* generator, seeded from
+ * the global seed and the destination. In record mode every decision is
+ * appended to the schedule file; in replay mode decisions are taken from
+ * the file instead, in order, for each destination separately. If the
+ * replayed run asks for a decision the log does not have, the live
+ * generator is used and the desynchronization is counted.
+ */
+static unsigned long long int
+link_seed(const network_address_t dest_address) {
+  /* splitmix64 of the seed and the address */
+  unsigned long long int z = ((unsigned long long int) faults.seed << 32)
+    ^ ((unsigned long long int) dest_address[0] << 16) ^ dest_address[1];
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return z ? z : 1;
+}
+
+/* uniform on [0,1) */
+static double
+link_uniform(network_link_t* link) {
+  link->rng ^= link->rng >> 12;
+  link->rng ^= link->rng << 25;
+  link->rng ^= link->rng >> 27;
+  return ((link->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static fault_stream_t*
+fault_stream(const network_address_t dest_address) {
+  int i;
+
+  for (i=0; i<faults.n_streams; i++)
+    if (network_address_same(faults.streams[i].dest, dest_address))
+      return &faults.streams[i];
+  return NULL;
+}
+
+/*
+ * find, or make, the state of a link. Returns NULL if there are
+ * NETWORK_MAX_LINKS links already, or if memory runs out. Called with
+ * interrupts disabled.
+ */
+static network_link_t*
+network_link(const network_address_t dest_address) {
+  unsigned int bucket = (dest_address[0] ^ (dest_address[1] * 2654435761u)) % LINK_BUCKETS;
+  network_link_t** table;
+  network_link_t* link;
+  int grown;
+
+  for (link=link_buckets[bucket]; link!=NULL; link=link->hash_next)
+    if (network_address_same(link->dest, dest_address))
+      return link;
+
+  if (n_links == NETWORK_MAX_LINKS)
+    return NULL;
+  if (n_links == max_links) {
+    grown = max_links ? 2 * max_links : 64;
+    table = (network_link_t **) realloc(links, grown * sizeof(network_link_t *));
+    if (table == NULL)
+      return NULL;
+    links = table;
+    max_links = grown;
+  }
+  link = (network_link_t *) malloc(sizeof(network_link_t));
+  if (link == NULL)
+    return NULL;
+
+  network_address_copy(dest_address, link->dest);
+  link->id = n_links;
+  link->hash_next = link_buckets[bucket];
+  link_buckets[bucket] = link;
+  link->rng = link_seed(dest_address);
+  link->replay = fault_stream(dest_address);
+  link->recorded = 0;
+  link->bad = 0;
+  link->busy_until = 0;
+  link->queued = 0;
+  links[n_links++] = link;
+  return link;
+}
+
+static void
+fault_record(network_link_t* link, int kind, int value) {
+  unsigned char bytes[3];
+
+  bytes[1] = link->id & 0xff;
+  bytes[2] = link->id >> 8;
+  if (!link->recorded) {
+    bytes[0] = FAULT_LINK;
+    fwrite(bytes, 1, 3, faults.file);
+    fwrite(link->dest, sizeof(network_address_t), 1, faults.file);
+    link->recorded = 1;
+  }
+
+  /* yes/no decisions keep their outcome in the top bit of the kind */
+  bytes[0] = kind | ((kind != FAULT_EMU_DELAY && value) ? 0x80 : 0);
+  fwrite(bytes, 1, 3, faults.file);
+  if (kind == FAULT_EMU_DELAY)
+    fwrite(&value, sizeof(int), 1, faults.file);
+}
+
+/*
+ * Push the decisions about a packet out to the file, so that a recorder
+ * that gets killed leaves a usable schedule behind.
+ */
+static void
+fault_flush() {
+  if (faults.mode == FAULT_RECORD)
+    fflush(faults.file);
+}
+
+static void fault_close();
+
+/*
+ * A decision is about to be made for a destination that has no link, and
+ * so cannot be logged or replayed. A recording stops there, loudly, rather
+ * than leave a schedule behind that does not match the run; a replay
+ * counts it as out of step.
+ */
+static void
+fault_unlinked(const network_address_t dest_address) {
+  char name[40];
+
+  if (faults.mode == FAULT_RECORD) {
+    network_format_address(dest_address, name, 40);
+    kprintf("NET:no room for the faults of %s, fault recording stopped.\n", name);
+    fault_close();
+    faults.mode = FAULT_LIVE;
+  }
+  else if (faults.mode == FAULT_REPLAY && faults.desyncs++ == 0)
+    kprintf("NET:fault schedule out of step, using live decisions.\n");
+}
+
+static int
+fault_replay(network_link_t* link, int kind, int* value) {
+  fault_stream_t* stream = link->replay;
+
+  if (stream == NULL || stream->next == stream->count
+      || stream->decisions[stream->next].kind != kind) {
+    if (faults.desyncs++ == 0)
+      kprintf("NET:fault schedule out of step, using live decisions.\n");
+    return 0;
+  }
+
+  *value = stream->decisions[stream->next++].value;
+  return 1;
+}
+
+/* decide an event that happens with probability p */
+static int
+link_decide(network_link_t* link, int kind, double p) {
+  int outcome;
+
+  if (faults.mode == FAULT_REPLAY && fault_replay(link, kind, &outcome))
+    return outcome;
+
+  outcome = (p > 0.0 && link_uniform(link) < p);
+  if (faults.mode == FAULT_RECORD)
+    fault_record(link, kind, outcome);
+  return outcome;
+}
+
+/* draw a one-way delay, in microseconds, from the configured distribution */
+static int
+link_delay(network_link_t* link, const network_emulator_params_t* params) {
+  double delay = params->delay_ms;
+  double jitter = params->jitter_ms;
+  double u, v;
+  int value;
+
+  if (faults.mode == FAULT_REPLAY && fault_replay(link, FAULT_EMU_DELAY, &value))
+    return value;
+
+  switch (params->distribution) {
+  case NETWORK_DELAY_UNIFORM:
+    delay += jitter * (2.0 * link_uniform(link) - 1.0);
+    break;
+  case NETWORK_DELAY_NORMAL:
+    /* Box-Muller */
+    do
+      u = link_uniform(link);
+    while (u <= 0.0);
+    v = link_uniform(link);
+    delay += jitter * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    break;
+  case NETWORK_DELAY_PARETO:
+    /* heavy tail with shape 3, scaled so that the mean excess is jitter */
+    do
+      u = link_uniform(link);
+    while (u <= 0.0);
+    delay += 2.0 * jitter * (pow(u, -1.0 / 3.0) - 1.0);
+    break;
+  default:
+    break;
+  }
+
+  value = (delay > 0.0) ? (int) (delay * 1000.0) : 0;
+  if (faults.mode == FAULT_RECORD)
+    fault_record(link, FAULT_EMU_DELAY, value);
+  return value;
+}
+
+/*
+ * The fate of a packet under the synthetic network: 0 to drop it, 1 to
+ * send it, 2 to send it twice.
+ */
+static int
+synthetic_copies(const network_address_t dest_address) {
+  interrupt_level_t old_level;
+  network_link_t* link;
+  int copies = 1;
+
+  old_level = set_interrupt_level(DISABLED);
+  link = network_link(dest_address);
+  if (link == NULL) {
+    fault_unlinked(dest_address);
+    copies = (genrand() < loss_rate) ? 0 : (genrand() < duplication_rate) ? 2 : 1;
+  }
+  else if (link_decide(link, FAULT_LOSS, loss_rate))
+    copies = 0;
+  else if (link_decide(link, FAULT_DUPLICATE, duplication_rate))
+    copies = 2;
+  fault_flush();
+  set_interrupt_level(old_level);
+
+  return copies;
+}
+
+static void
+fault_close() {
+  if (faults.file != NULL)
+    fclose(faults.file);
+  faults.file = NULL;
+}
+
+void
+network_fault_seed(unsigned int seed) {
+  interrupt_level_t old_level;
+  int i;
+
+  old_level = set_interrupt_level(DISABLED);
+  faults.seed = seed;
+  for (i=0; i<n_links; i++)
+    links[i]->rng = link_seed(links[i]->dest);
+  set_interrupt_level(old_level);
+}
+
+int
+network_fault_record(const char* filename) {
+  static int closing = 0;
+  interrupt_level_t old_level;
+  unsigned int header[2];
+  FILE* file;
+  int i;
+
+  file = fopen(filename, "wb");
+  if (file == NULL)
+    return -1;
+  header[0] = FAULT_MAGIC;
+  header[1] = faults.seed;
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    fclose(file);
+    return -1;
+  }
+
+  old_level = set_interrupt_level(DISABLED);
+  fault_close();
+  faults.file = file;
+  faults.mode = FAULT_RECORD;
+  for (i=0; i<n_links; i++)
+    links[i]->recorded = 0;
+  set_interrupt_level(old_level);
+
+  if (!closing)
+    closing = (atexit(fault_close) == 0);
+  return 0;
+}
+
+int
+network_fault_replay(const char* filename) {
+  interrupt_level_t old_level;
+  fault_stream_t* streams = NULL;
+  fault_stream_t* stream;
+  fault_decision_t* decisions;
+  unsigned char bytes[3];
+  unsigned int header[2];
+  int* ids;
+  int n_streams = 0, max_streams = 0;
+  int i, id, value;
+  FILE* file;
+
+  file = fopen(filename, "rb");
+  if (file == NULL)
+    return -1;
+  ids = (int *) malloc(NETWORK_MAX_LINKS * sizeof(int));
+  if (ids == NULL || fread(header, sizeof(header), 1, file) != 1 || header[0] != FAULT_MAGIC) {
+    free(ids);
+    fclose(file);
+    return -1;
+  }
+
+  for (i=0; i<NETWORK_MAX_LINKS; i++)
+    ids[i] = -1;
+
+  /* a record cut short at the end (the recorder was killed) is ignored */
+  while (fread(bytes, 1, 3, file) == 3) {
+    id = bytes[1] | (bytes[2] << 8);
+    if (bytes[0] == FAULT_LINK) {
+      if (n_streams == max_streams) {
+        max_streams = max_streams ? 2 * max_streams : 64;
+        stream = (fault_stream_t *) realloc(streams, max_streams * sizeof(fault_stream_t));
+        if (stream == NULL)
+          break;
+        streams = stream;
+      }
+      stream = &streams[n_streams];
+      memset(stream, 0, sizeof(fault_stream_t));
+      if (fread(stream->dest, sizeof(network_address_t), 1, file) != 1)
+        break;
+      ids[id] = n_streams++;
+      continue;
+    }
+
+    value = (bytes[0] & 0x80) ? 1 : 0;
+    if ((bytes[0] & 0x7f) == FAULT_EMU_DELAY
+        && fread(&value, sizeof(int), 1, file) != 1)
+      break;
+    if (ids[id] == -1)
+      continue;
+
+    stream = &streams[ids[id]];
+    if (stream->count == stream->capacity) {
+      stream->capacity = stream->capacity ? 2 * stream->capacity : 256;
+      decisions = (fault_decision_t *) realloc(stream->decisions,
+                                               stream->capacity * sizeof(fault_decision_t));
+      if (decisions == NULL)
+        break;
+      stream->decisions = decisions;
+    }
+    stream->decisions[stream->count].kind = bytes[0] & 0x7f;
+    stream->decisions[stream->count].value = value;
+    stream->count++;
+  }
+  fclose(file);
+  free(ids);
+
+  old_level = set_interrupt_level(DISABLED);
+  fault_close();
+  for (i=0; i<faults.n_streams; i++)
+    free(faults.streams[i].decisions);
+  free(faults.streams);
+  faults.streams = streams;
+  faults.n_streams = n_streams;
+  faults.seed = header[1];
+  faults.desyncs = 0;
+  faults.mode = FAULT_REPLAY;
+  for (i=0; i<n_links; i++) {
+    links[i]->rng = link_seed(links[i]->dest);
+    links[i]->replay = fault_stream(links[i]->dest);
+  }
+  set_interrupt_level(old_level);
+
+  return 0;
+}
+
+long long int
+network_fault_desyncs() {
+  return faults.desyncs;
+}
+
+/*
+ * Put one copy of a packet on the link: tail drop when the link queue is
+ * full, then the bandwidth cap and the delay (or none, to reorder it).
+ * Called with the mutex held.
+ */
+static void
+emulator_enqueue(network_link_t* link, const struct iovec* iov, int iovcnt,
+                 int pktlen, long long int now, int flags) {
+  network_emulator_params_t* params = &emulator.params;
+  emulator_packet_t* packet;
+  long long int deliver_at;
+  char* bufp;
+  int i;
+
+  if (params->queue_limit > 0 && link->queued >= params->queue_limit) {
+    emulator.stats.tail_dropped++;
+    return;
+  }
+
+  packet = (emulator_packet_t *) malloc(sizeof(emulator_packet_t) + pktlen);
+  if (packet == NULL) {
+    emulator.stats.tail_dropped++;
+    return;
+  }
+
+  bufp = packet->data;
+  for (i=0; i<iovcnt; i++) {
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  packet->size = pktlen;
+  packet->link = link;
+  packet->flags = flags;
+
+  /* serialize behind whatever the link is still sending */
+  if (link->busy_until < now)
+    link->busy_until = now;
+  if (params->bandwidth_kbps > 0.0)
+    link->busy_until += (long long int) (pktlen * 8.0 / params->bandwidth_kbps * 1000.0);
+
+  if (link_decide(link, FAULT_EMU_REORDER, params->reorder_rate)) {
+    deliver_at = link->busy_until;
+    emulator.stats.reordered++;
+  }
+  else
+    deliver_at = link->busy_until + link_delay(link, params);
+
+  if (emulator.heap == NULL || heap_insert(emulator.heap, &packet->node, deliver_at) == -1) {
+    free(packet);
+    emulator.stats.tail_dropped++;
+    return;
+  }
+  link->queued++;
+  emulator.stats.queued++;
+}
+
+/*
+ * Hand a packet to the emulator. Returns -1 if the emulator cannot keep
+ * state for its destination, and the packet is to be sent as usual.
+ */
+static int
+emulator_send(const network_address_t dest_address,
+              const struct iovec* iov, int iovcnt, int pktlen) {
+  network_emulator_params_t* params = &emulator.params;
+  network_link_t* link;
+  interrupt_level_t old_level;
+  long long int now = emulator_now();
+  double loss;
+
+  /* fault decisions are only ever made by minithreads */
+  old_level = set_interrupt_level(DISABLED);
+  pthread_mutex_lock(&emulator.mutex);
+
+  /* a destination the emulator has no room for is not emulated at all */
+  link = network_link(dest_address);
+  if (link == NULL) {
+    fault_unlinked(dest_address);
+    emulator.stats.unemulated++;
+    pthread_mutex_unlock(&emulator.mutex);
+    set_interrupt_level(old_level);
+    return -1;
+  }
+
+  /* Gilbert-Elliott: move between the good and the bad state, then lose */
+  if (link->bad) {
+    if (link_uniform(link) < params->p_bad_to_good)
+      link->bad = 0;
+  }
+  else if (link_uniform(link) < params->p_good_to_bad)
+    link->bad = 1;
+  loss = link->bad ? params->loss_bad : params->loss_good;
+  if (link_decide(link, FAULT_EMU_LOSS, loss)) {
+    emulator.stats.lost++;
+    capture_send(dest_address, CAPTURE_EMULATOR | CAPTURE_DROPPED, iov, iovcnt, pktlen);
+    goto done;
+  }
+
+  if (link_decide(link, FAULT_EMU_DUPLICATE, params->duplication_rate)) {
+    emulator.stats.duplicated++;
+    emulator_enqueue(link, iov, iovcnt, pktlen, now,
+                     CAPTURE_EMULATOR | CAPTURE_DUPLICATE);
+  }
+  emulator_enqueue(link, iov, iovcnt, pktlen, now, CAPTURE_EMULATOR);
+  pthread_cond_signal(&emulator.wakeup);
+
+ done:
+  fault_flush();
+  pthread_mutex_unlock(&emulator.mutex);
+  set_interrupt_level(old_level);
+  return pktlen;
+}
+
+/*
+ * The emulator thread: sleeps until the earliest packet is due and sends
+ * it. It never touches minithread state, so emulated packets always go
+ * through the socket, even to ourselves.
+ */
+static void*
+emulator_thread(void* arg) {
+  emulator_packet_t* packet;
+  heap_node_t* node;
+  struct sockaddr_in sin;
+  struct timespec ts;
+  long long int now;
+
+  pthread_mutex_lock(&emulator.mutex);
+  while(true) {
+    node = heap_peek(emulator.heap);
+    if (node == NULL) {
+      pthread_cond_wait(&emulator.wakeup, &emulator.mutex);
+      continue;
+    }
+
+    now = emulator_now();
+    if (node->key > now) {
+      ts.tv_sec = node->key / 1000000;
+      ts.tv_nsec = (node->key % 1000000) * 1000;
+      pthread_cond_timedwait(&emulator.wakeup, &emulator.mutex, &ts);
+      continue;
+    }
+
+    heap_extract_min(emulator.heap, &node);
+    packet = heap_entry(node, emulator_packet_t, node);
+    packet->link->queued--;
+    emulator.stats.queued--;
+    emulator.stats.sent++;
+    network_address_to_sockaddr(packet->link->dest, &sin);
+    pthread_mutex_unlock(&emulator.mutex);
+
+    /* captured when it leaves, so that the capture shows the delays */
+    if (capture_active) {
+      struct iovec iov = { packet->data, packet->size };
+      capture_send(packet->link->dest, packet->flags, &iov, 1, packet->size);
+    }
+    sendto(if_info.sock, packet->data, packet->size, 0,
+           (struct sockaddr *) &sin, sizeof(sin));
+    free(packet);
+
+    pthread_mutex_lock(&emulator.mutex);
+  }
+
+  return NULL;
+}
+
+/* create the heap and the thread the first time the emulator is enabled */
+static int
+emulator_start() {
+  pthread_condattr_t attr;
+  pthread_t thread;
+  sigset_t set, old_set;
+
+  if (emulator.started)
+    return 0;
+
+  emulator.heap = heap_new();
+  if (emulator.heap == NULL)
+    return -1;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&emulator.wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  /* like the poll thread, the emulator thread must not take interrupts */
+  sigemptyset(&set);
+  sigaddset(&set,SIGRTMAX-1);
+  sigaddset(&set,SIGRTMAX-2);
+  pthread_sigmask(SIG_BLOCK,&set,&old_set);
+  AbortOnCondition(pthread_create(&thread, NULL, emulator_thread, NULL),
+      "pthread");
+  pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+
+  emulator.started = 1;
+  return 0;
+}
+
+int
+network_emulator_set(const network_emulator_params_t* params) {
+  interrupt_level_t old_level;
+  int result = 0;
+
+  old_level = set_interrupt_level(DISABLED);
+  pthread_mutex_lock(&emulator.mutex);
+  if (params == NULL)
+    emulator.enabled = 0;
+  else if (emulator_start() == 0) {
+    emulator.params = *params;
+    emulator.enabled = 1;
+  }
+  else
+    result = -1;
+  pthread_mutex_unlock(&emulator.mutex);
+  set_interrupt_level(old_level);
+
+  return result;
+}
+
+void
+network_emulator_get_stats(network_emulator_stats_t* stats) {
+  interrupt_level_t old_level;
+
+  old_level = set_interrupt_level(DISABLED);
+  pthread_mutex_lock(&emulator.mutex);
+  *stats = emulator.stats;
+  pthread_mutex_unlock(&emulator.mutex);
+  set_interrupt_level(old_level);
+}
+
+/*
+ * Run every packet waiting on the loopback queue through the user's handler.
+ * Packets the handler sends to ourselves are queued behind them and handled
+ * by the same loop, so the handler is never reentered.
+ */
+static void
+loopback_deliver() {
+  mpsc_node_t* node;
+
+  if (loopback.draining)
+    return;
+
+  loopback.draining = 1;
+  while (mpsc_queue_pop(loopback.ready, &node) == 0) {
+    packet_t* packet = mpsc_entry(node, packet_t, node);
+    user_network_handler(&packet->arg);
+  }
+  loopback.draining = 0;
+}
+
+/*
+ * Deliver a packet to ourselves. Like a UDP send, this succeeds even when
+ * the packet has to be dropped for lack of buffers.
+ */
+static int
+loopback_send(const struct iovec* iov, int iovcnt, int pktlen) {
+  interrupt_level_t old_level;
+  packet_t* packet = NULL;
+  char* bufp;
+  int i;
+
+  old_level = set_interrupt_level(DISABLED);
+
+  if (pktlen <= PACKET_SMALL_SIZE)
+    packet = packet_pool_get(loopback.pool.small_free);
+  if (packet == NULL)
+    packet = packet_pool_get(loopback.pool.large_free);
+  if (packet == NULL) {
+    loopback.pool.dropped++;
+    set_interrupt_level(old_level);
+    return pktlen;
+  }
+
+  bufp = packet->data;
+  for (i=0; i<iovcnt; i++) {
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  packet->arg.size = pktlen;
+  network_address_copy(loopback.address, packet->arg.sender);
+  capture_receive(packet);
+
+  mpsc_queue_push(loopback.ready, &packet->node);
+  loopback_deliver();
+
+  set_interrupt_level(old_level);
+  return pktlen;
+}
+
+static int
+futex(int* uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* is the process that published an inbox still around? */
+static int
+shm_owner_alive(int pid) {
+  return (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM));
+}
+
+/*
+ * Map the inbox of the process listening on port, if it has one, and
+ * claim a ring in it: a free one, or one whose sender has died.
+ */
+static int
+shm_attach(shm_peer_t* peer) {
+  char name[32];
+  struct stat st;
+  shm_inbox_t* inbox;
+  int fd, i, owner;
+  int me = getpid();
+
+  sprintf(name, SHM_NAME_FORMAT, ntohs(peer->port));
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) != 0 || st.st_size != sizeof(shm_inbox_t)) {
+    close(fd);
+    return -1;
+  }
+  inbox = (shm_inbox_t *) mmap(NULL, sizeof(shm_inbox_t), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+  close(fd);
+  if (inbox == MAP_FAILED)
+    return -1;
+
+  if (__atomic_load_n(&inbox->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+      || inbox->closed || !shm_owner_alive(inbox->pid)) {
+    munmap(inbox, sizeof(shm_inbox_t));
+    return -1;
+  }
+
+  for (i=0; i<SHM_MAX_RINGS; i++) {
+    owner = __atomic_load_n(&inbox->rings[i].owner, __ATOMIC_ACQUIRE);
+    if (owner == me || ((owner == 0 || !shm_owner_alive(owner)) &&
+        __atomic_compare_exchange_n(&inbox->rings[i].owner, &owner, me, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+      peer->inbox = inbox;
+      peer->ring = &inbox->rings[i];
+      return 0;
+    }
+  }
+
+  munmap(inbox, sizeof(shm_inbox_t));
+  return -1;
+}
+
+static void
+shm_detach(shm_peer_t* peer) {
+  if (peer->inbox != NULL)
+    munmap(peer->inbox, sizeof(shm_inbox_t));
+  peer->inbox = NULL;
+  peer->ring = NULL;
+}
+
+/* find, or make, the entry for the process listening on port */
+static shm_peer_t*
+shm_lookup(unsigned int port) {
+  shm_peer_t* peer;
+  int i;
+
+  for (i=0; i<shm.n_peers; i++)
+    if (shm.peers[i].port == port)
+      return &shm.peers[i];
+
+  if (shm.n_peers == SHM_MAX_PEERS)
+    return NULL;
+
+  peer = &shm.peers[shm.n_peers++];
+  peer->port = port;
+  peer->inbox = NULL;
+  peer->ring = NULL;
+  peer->retry_at = 0;
+  return peer;
+}
+
+/*
+ * Copy a packet into our ring in the inbox of a process on this host.
+ * Returns -1 if the destination has no inbox, in which case the packet
+ * should go out through the socket instead. As with UDP, a packet that
+ * does not fit in the ring is dropped.
+ */
+static int
+shm_send(const network_address_t dest_address,
+         const struct iovec* iov, int iovcnt, int pktlen) {
+  interrupt_level_t old_level;
+  shm_peer_t* peer;
+  shm_ring_t* ring;
+  shm_record_t* record;
+  unsigned int head, tail, pos, need, pad;
+  char* bufp;
+  int i;
+
+  if (shm.inbox == NULL || !network_address_is_colocated(dest_address))
+    return -1;
+
+  old_level = set_interrupt_level(DISABLED);
+
+  peer = shm_lookup(dest_address[1]);
+  if (peer == NULL) {
+    set_interrupt_level(old_level);
+    return -1;
+  }
+  if (peer->inbox != NULL && __atomic_load_n(&peer->inbox->closed, __ATOMIC_ACQUIRE))
+    shm_detach(peer);
+  if (peer->inbox == NULL) {
+    if (currentTimeMillis() < peer->retry_at || shm_attach(peer) == -1) {
+      if (peer->inbox == NULL && currentTimeMillis() >= peer->retry_at)
+        peer->retry_at = currentTimeMillis() + SHM_RETRY_MS;
+      set_interrupt_level(old_level);
+      return -1;
+    }
+  }
+
+  ring = peer->ring;
+  need = (sizeof(shm_record_t) + pktlen + SHM_RECORD_ALIGN - 1) & ~(SHM_RECORD_ALIGN - 1);
+  tail = ring->tail;
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  pos = tail % SHM_RING_BYTES;
+  pad = (pos + need > SHM_RING_BYTES) ? SHM_RING_BYTES - pos : 0;
+
+  if (SHM_RING_BYTES - (tail - head) < pad + need) {
+    shm.dropped++;
+    set_interrupt_level(old_level);
+    return pktlen;
+  }
+
+  if (pad > 0) {
+    ((shm_record_t *) (ring->data + pos))->size = -1;
+    tail += pad;
+    pos = 0;
+  }
+
+  record = (shm_record_t *) (ring->data + pos);
+  record->size = pktlen;
+  network_address_copy(loopback.address, record->sender);
+  bufp = (char *) (record + 1);
+  for (i=0; i<iovcnt; i++) {
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  __atomic_store_n(&ring->tail, tail + need, __ATOMIC_SEQ_CST);
+
+  /* ring the doorbell only if the receiver is going to sleep */
+  if (__atomic_load_n(&peer->inbox->waiting, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&peer->inbox->doorbell, 1, __ATOMIC_SEQ_CST);
+    futex(&peer->inbox->doorbell, FUTEX_WAKE, 1);
+  }
+
+  set_interrupt_level(old_level);
+  return pktlen;
+}
+
+/*
+ * Stop reading a ring of our inbox whose sender wrote something that
+ * cannot be a record. Whatever it sends from then on fills the ring and
+ * is dropped at its end.
+ */
+static void
+shm_close_ring(int i) {
+  shm.ring_closed[i] = 1;
+  if (DEBUG)
+    kprintf("NET:closing corrupt shared-memory ring %d.\n", i);
+}
+
+/*
+ * Take the waiting records off every ring of our inbox, up to max of
+ * them, and turn them into pooled packets. The rings are written by
+ * other processes, so every size and counter in them is checked before
+ * it is used, and read only once.
+ */
+static int
+shm_receive(poll_thread_t* thread, mpsc_node_t** ready, int max) {
+  shm_inbox_t* inbox = shm.inbox;
+  shm_ring_t* ring;
+  shm_record_t* record;
+  packet_t* packet;
+  unsigned int head, tail, pos, skip;
+  int i, size, n = 0;
+
+  for (i=0; i<SHM_MAX_RINGS && n<max; i++) {
+    if (shm.ring_closed[i])
+      continue;
+    ring = &inbox->rings[i];
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (tail - head > SHM_RING_BYTES) {
+      shm_close_ring(i);
+      continue;
+    }
+
+    while (head != tail && n < max) {
+      pos = head % SHM_RING_BYTES;
+      record = (shm_record_t *) (ring->data + pos);
+      size = __atomic_load_n(&record->size, __ATOMIC_RELAXED);
+      if (size < 0)
+        skip = SHM_RING_BYTES - pos;
+      else if (size > MAX_NETWORK_PKT_SIZE
+               || (unsigned int) size > SHM_RING_BYTES - pos - sizeof(shm_record_t))
+        skip = SHM_RING_BYTES + 1;
+      else
+        skip = (sizeof(shm_record_t) + size + SHM_RECORD_ALIGN - 1) & ~(SHM_RECORD_ALIGN - 1);
+      if (skip > tail - head) {
+        shm_close_ring(i);
+        break;
+      }
+      head += skip;
+      if (size < 0)
+        continue;
+
+      packet = NULL;
+      if (size <= PACKET_SMALL_SIZE)
+        packet = packet_pool_get(thread->pool.small_free);
+      if (packet == NULL)
+        packet = packet_pool_get(thread->pool.large_free);
+      if (packet != NULL) {
+        memcpy(packet->data, record + 1, size);
+        packet->arg.size = size;
+        network_address_copy(record->sender, packet->arg.sender);
+        capture_receive(packet);
+        ready[n++] = &packet->node;
+      }
+      else
+        thread->pool.dropped++;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+
+  return n;
+}
+
+/*
+ * The poll thread of the shared-memory transport: drains the inbox, and
+ * sleeps on the doorbell when it is empty.
+ */
+static int
+network_poll_shm(void* arg) {
+  poll_thread_t* thread = (poll_thread_t *) arg;
+  shm_inbox_t* inbox = shm.inbox;
+  mpsc_node_t* ready[NETWORK_RECV_BATCH];
+  int n, doorbell;
+
+  while (shm.inbox != NULL) {
+    n = shm_receive(thread, ready, NETWORK_RECV_BATCH);
+
+    if (n == 0) {
+      /* announce that we will sleep, then look once more before we do */
+      doorbell = __atomic_load_n(&inbox->doorbell, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&inbox->waiting, 1, __ATOMIC_SEQ_CST);
+      n = shm_receive(thread, ready, NETWORK_RECV_BATCH);
+      if (n == 0)
+        futex(&inbox->doorbell, FUTEX_WAIT, doorbell);
+      __atomic_store_n(&inbox->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    mpsc_queue_push_batch(thread->ready, ready, n);
+  }
+
+  return 0;
+}
+
+/* tell senders that an inbox is gone and remove its name */
+static void
+shm_close_inbox(const char* name, shm_inbox_t* inbox) {
+  __atomic_store_n(&inbox->closed, 1, __ATOMIC_RELEASE);
+  shm_unlink(name);
+}
+
+static void
+shm_cleanup() {
+  if (shm.inbox != NULL)
+    shm_close_inbox(shm.name, shm.inbox);
+}
+
+/*
+ * Publish our inbox. An inbox already under our name is reclaimed only if
+ * the process whose pid is in it has gone away; it is closed so that
+ * senders still attached to it notice. The owner may well be alive, since
+ * with several receive sockets the UDP port is bound with SO_REUSEPORT and
+ * another process can hold it too; that process keeps its inbox, and we
+ * do without one. So do we if the inbox is still being set up, and has no
+ * pid yet.
+ */
+static int
+shm_initialize() {
+  shm_inbox_t* inbox;
+  struct stat st;
+  int fd, pid;
+
+  sprintf(shm.name, SHM_NAME_FORMAT, (unsigned short) my_udp_port);
+
+  fd = shm_open(shm.name, O_RDWR, 0);
+  if (fd >= 0) {
+    if (fstat(fd, &st) != 0 || st.st_size != sizeof(shm_inbox_t)) {
+      close(fd);
+      return -1;
+    }
+    inbox = (shm_inbox_t *) mmap(NULL, sizeof(shm_inbox_t), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (inbox == MAP_FAILED)
+      return -1;
+    pid = __atomic_load_n(&inbox->pid, __ATOMIC_ACQUIRE);
+    if (pid == 0 || (pid != getpid() && shm_owner_alive(pid))) {
+      munmap(inbox, sizeof(shm_inbox_t));
+      return -1;
+    }
+    shm_close_inbox(shm.name, inbox);
+    munmap(inbox, sizeof(shm_inbox_t));
+  }
+
+  fd = shm_open(shm.name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, sizeof(shm_inbox_t)) != 0) {
+    close(fd);
+    shm_unlink(shm.name);
+    return -1;
+  }
+  inbox = (shm_inbox_t *) mmap(NULL, sizeof(shm_inbox_t), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+  close(fd);
+  if (inbox == MAP_FAILED) {
+    shm_unlink(shm.name);
+    return -1;
+  }
+
+  __atomic_store_n(&inbox->pid, getpid(), __ATOMIC_RELEASE);
+  __atomic_store_n(&inbox->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  shm.inbox = inbox;
+  atexit(shm_cleanup);
+
+  return 0;
+}
+
+/*
+ * The network interrupt handler: runs, with interrupts disabled, every
+ * packet that is ready through the user's handler in a single pass.
+ * Packets the handler sends are batched until the pass is over.
+ */
+static void
+network_interrupt(void* arg) {
+  poll_thread_t* thread = (poll_thread_t *) arg;
+  mpsc_node_t* node;
+
+  in_interrupt_batch = 1;
+  while (mpsc_queue_pop(thread->ready, &node) == 0) {
+    packet_t* packet = mpsc_entry(node, packet_t, node);
+    user_network_handler(&packet->arg);
+  }
+  in_interrupt_batch = 0;
+
+  /* replies (e.g. ACKs) sent by the handler leave in one go */
+  if (network_batch_length(interrupt_batch) > 0)
+    network_send_batch(interrupt_batch);
+}
+
+/* doorbell of the ready queue, runs on the poll thread */
+static void
+network_doorbell(void* arg) {
+  if (DEBUG)
+    kprintf("NET:raising network interrupt.\n");
+  send_interrupt(NETWORK_INTERRUPT_TYPE, mini_network_handler, arg);
+}
+
+/*
+ * Receive loop used when GRO is enabled. The kernel may hand us several
+ * consecutive segments from one sender coalesced into a single buffer, with
+ * the segment size in a control message; they are split back into pooled
+ * packets here, so the handler still sees one packet per segment.
+ */
+static int
+network_poll_gro(poll_thread_t* thread) {
+  mpsc_node_t* ready[NETWORK_RECV_BATCH];
+  struct sockaddr_in addr;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  packet_t* packet;
+  int n_ready, size, seg_size, offset, len;
+
+  while(true) {
+    iov.iov_base = thread->gro_buffer;
+    iov.iov_len = UDP_MAX_PAYLOAD;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    size = recvmsg(thread->sock, &msg, 0);
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size < 0) {
+      kprintf("NET:Error, %d.\n", errno);
+      AbortOnCondition(1,"Crashing.");
+    }
+
+    seg_size = size;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        seg_size = *((int *) CMSG_DATA(cmsg));
+
+    if (size == 0 || seg_size <= 0 || seg_size > MAX_NETWORK_PKT_SIZE
+        || (msg.msg_flags & MSG_TRUNC)) {
+      thread->pool.dropped++;
+      continue;
+    }
+
+    n_ready = 0;
+    for (offset=0; offset<size; offset+=seg_size) {
+      len = (size - offset < seg_size) ? size - offset : seg_size;
+
+      packet = NULL;
+      if (len <= PACKET_SMALL_SIZE)
+        packet = packet_pool_get(thread->pool.small_free);
+      if (packet == NULL)
+        packet = packet_pool_get(thread->pool.large_free);
+      if (packet == NULL) {
+        thread->pool.dropped++;
+        continue;
+      }
+
+      memcpy(packet->data, thread->gro_buffer + offset, len);
+      packet->arg.size = len;
+      sockaddr_to_network_address(&addr, packet->arg.sender);
+      capture_receive(packet);
+      ready[n_ready++] = &packet->node;
+
+      if (n_ready == NETWORK_RECV_BATCH) {
+        mpsc_queue_push_batch(thread->ready, ready, n_ready);
+        n_ready = 0;
+      }
+    }
+
+    mpsc_queue_push_batch(thread->ready, ready, n_ready);
+  }
+}
+
+int network_poll(void* arg) {
+  poll_thread_t* thread;
+  packet_t* spare[NETWORK_RECV_BATCH];
+  packet_t* packet;
+  packet_t* small;
+  mpsc_node_t* ready[NETWORK_RECV_BATCH];
+  struct mmsghdr msgs[NETWORK_RECV_BATCH];
+  struct iovec iovecs[NETWORK_RECV_BATCH];
+  struct sockaddr_in addrs[NETWORK_RECV_BATCH];
+  struct sockaddr_in addr;
+  unsigned int fromlen = sizeof(struct sockaddr_in);
+  static char discard[MAX_NETWORK_PKT_SIZE];
+  int n_spare = 0;
+  int n_ready;
+  int i, j, n, size;
+
+  thread = (poll_thread_t *) arg;
+
+  if (thread->gro_buffer != NULL)
+    return network_poll_gro(thread);
+
+  while(true) {
+
+    /* 
+     * every packet is received into a large buffer; buffers that were not
+     * handed out last time round are reused. We rely on the handler to
+     * release the packets.
+     */
+    while (n_spare < NETWORK_RECV_BATCH &&
+           (spare[n_spare] = packet_pool_get(thread->pool.large_free)) != NULL)
+      n_spare++;
+
+    if (n_spare == 0) {
+      /* pool exhausted: drain one datagram and drop it */
+      size = recvfrom(thread->sock, discard, MAX_NETWORK_PKT_SIZE,
+                      0, (struct sockaddr *) &addr, &fromlen);
+      AbortOnCondition(size < 0, "Crashing.");
+      thread->pool.dropped++;
+      if (DEBUG)
+        kprintf("NET:Packet pool exhausted, %lld packets dropped.\n",
+                thread->pool.dropped);
+      continue;
+    }
+
+    memset(msgs, 0, n_spare * sizeof(struct mmsghdr));
+    for (i=0; i<n_spare; i++) {
+      iovecs[i].iov_base = spare[i]->data;
+      iovecs[i].iov_len = MAX_NETWORK_PKT_SIZE;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* block for the first datagram, then take whatever else is queued */
+    n = recvmmsg(thread->sock, msgs, n_spare, MSG_WAITFORONE, NULL);
+    if (n <= 0) {
+      kprintf("NET:Error, %d.\n", errno);
+      AbortOnCondition(1,"Crashing.");
+    }
+
+    n_ready = 0;
+    for (i=0; i<n; i++) {
+      size = msgs[i].msg_len;
+      if (size == 0)
+        continue;
+      if (DEBUG)
+        kprintf("NET:Received a packet, seqno %d.\n", ntohl(*((int *) spare[i]->data)));
+
+      /* right-size: copy small packets out and keep the large buffer */
+      if (size <= PACKET_SMALL_SIZE &&
+          (small = packet_pool_get(thread->pool.small_free)) != NULL) {
+        memcpy(small->data, spare[i]->data, size);
+        packet = small;
+      }
+      else {
+        packet = spare[i];
+        spare[i] = NULL;
+      }
+      packet->arg.size = size;
+   
+      assert(msgs[i].msg_hdr.msg_namelen == sizeof(struct sockaddr_in));
+      sockaddr_to_network_address(&addrs[i], packet->arg.sender);
+      capture_receive(packet);
+      ready[n_ready++] = &packet->node;
+    }
+
+    /* keep the large buffers that were not handed out */
+    for (i=0, j=0; i<n_spare; i++)
+      if (spare[i] != NULL)
+        spare[j++] = spare[i];
+    n_spare = j;
+
+    /* 
+     * now we have filled in the args to the network interrupt service
+     * routine, so we have to get the user's thread to run it.
+     */
+    mpsc_queue_push_batch(thread->ready, ready, n_ready);
+  }     
+}
+
+/* 
+ * start polling for network packets. this is separate so that clock interrupts
+ * can be turned on without network interrupts. however, this function requires
  * that clock_init has been called!
  */
-void start_network_poll(interrupt_handler_t network_handler, int* s) {
+void start_network_poll(interrupt_handler_t network_handler, poll_thread_t* thread) {
   pthread_t network_thread;
   sigset_t set;
   sigset_t old_set;
@@ -474,7 +2416,7 @@ void start_network_poll(interrupt_handler_t network_handler, int* s) {
   sigprocmask(SIG_BLOCK,&set,&old_set);
 
   /* create clock and return threads, but discard ids */
-  AbortOnCondition(pthread_create(&network_thread, NULL, (void*)network_poll, s),
+  AbortOnCondition(pthread_create(&network_thread, NULL, (void*)thread->poll, thread),
       "pthread");
 
   sa.sa_handler = (void*)handle_interrupt;
@@ -489,42 +2431,145 @@ void start_network_poll(interrupt_handler_t network_handler, int* s) {
   pthread_sigmask(SIG_SETMASK,&old_set,NULL);
 }
 
-int
-network_initialize(network_handler_t network_handler) {
+/*
+ * Open a UDP socket bound to our port. Sockets that share the port with
+ * SO_REUSEPORT must all ask for it before they bind.
+ */
+static int
+network_bind_socket(int reuseport) {
+  struct sockaddr_in sin;
   int arg = 1;
-  mini_network_handler=(interrupt_handler_t) network_handler;
+  int sock;
 
-  memset(&if_info, 0, sizeof(if_info));
-  
-  if_info.sock = socket(PF_INET, SOCK_DGRAM, 0);
-  if (if_info.sock < 0)  {
+  sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)  {
     perror("socket");
     return -1;
   }
 
-  if_info.sin.sin_family = SOCK_DGRAM;
-  if_info.sin.sin_addr.s_addr = htonl(0);
-  if_info.sin.sin_port = htons(my_udp_port);
-  if (bind(if_info.sock, (struct sockaddr *) &if_info.sin, 
-           sizeof(if_info.sin)) < 0)  {
+  if (reuseport &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *) &arg, sizeof(int)) != 0) {
+    perror("setsockopt");
+    close(sock);
+    return -1;
+  }
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = SOCK_DGRAM;
+  sin.sin_addr.s_addr = htonl(0);
+  sin.sin_port = htons(my_udp_port);
+  if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0)  {
     /* kprintf("Error: code %ld.\n", GetLastError());*/
     AbortOnError(0);
     perror("bind");
+    close(sock);
     return -1;
   }
 
   /* set for fast reuse */
-  assert(setsockopt(if_info.sock, SOL_SOCKET, SO_REUSEADDR, 
+  assert(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 
                     (char *) &arg, sizeof(int)) == 0);
 
+  return sock;
+}
+
+/* set up the buffers of a poll thread that receives from sock */
+static int
+poll_thread_initialize(poll_thread_t* thread, int sock) {
+  int arg = 1;
+
+  thread->poll = network_poll;
+  thread->sock = sock;
+  thread->gro_buffer = NULL;
+  if (gro_enabled) {
+    thread->gro_buffer = (char *) malloc(UDP_MAX_PAYLOAD);
+    if (thread->gro_buffer != NULL &&
+        setsockopt(sock, SOL_UDP, UDP_GRO, (char *) &arg, sizeof(int)) != 0) {
+      if (DEBUG)
+        kprintf("NET:UDP_GRO not supported, receiving without it.\n");
+      free(thread->gro_buffer);
+      thread->gro_buffer = NULL;
+    }
+  }
+  thread->ready = mpsc_queue_new(network_doorbell, thread);
+  if (thread->ready == NULL || packet_pool_initialize(&thread->pool) == -1)
+    return -1;
+
+  return 0;
+}
+
+int
+network_initialize(network_handler_t network_handler) {
+  int i;
+  user_network_handler = network_handler;
+  mini_network_handler = network_interrupt;
+
+  memset(&if_info, 0, sizeof(if_info));
+
+  /*
+   * With several receive sockets the kernel spreads incoming datagrams
+   * over them by a hash of the source address and port, so all the packets
+   * of a connection go through the same poll thread and ready queue, and
+   * keep their order. The first socket is also the one we send from.
+   */
+  for (i=0; i<recv_sockets; i++) {
+    int sock = network_bind_socket(recv_sockets > 1);
+    if (sock < 0)
+      return -1;
+    if (i == 0) {
+      if_info.sock = sock;
+      if_info.sin.sin_family = SOCK_DGRAM;
+      if_info.sin.sin_addr.s_addr = htonl(0);
+      if_info.sin.sin_port = htons(my_udp_port);
+    }
+    poll_threads[i].sock = sock;
+  }
+
   if (BCAST_ENABLED)
     bcast_initialize(BCAST_TOPOLOGY_FILE, &topology);
 
   /*
-   * Interrupts are handled through the caller's handler.
+   * Interrupts are handled through the caller's handler, called once for
+   * each packet by network_interrupt.
    */
 
-  start_network_poll(mini_network_handler, &if_info.sock);
+  for (i=0; i<recv_sockets; i++)
+    if (poll_thread_initialize(&poll_threads[i], poll_threads[i].sock) == -1) {
+      kprintf("Error: could not allocate the network buffers.\n");
+      return -1;
+    }
+  interrupt_batch = network_batch_new();
+  if (interrupt_batch == NULL) {
+    kprintf("Error: could not allocate the network buffers.\n");
+    return -1;
+  }
+
+  network_get_my_address(loopback.address);
+  loopback.draining = 0;
+  if (packet_pool_initialize(&loopback.pool) == -1 ||
+      (loopback.ready = mpsc_queue_new(NULL, NULL)) == NULL) {
+    kprintf("Error: could not allocate the network buffers.\n");
+    return -1;
+  }
+
+  for (i=0; i<recv_sockets; i++)
+    start_network_poll(mini_network_handler, &poll_threads[i]);
+
+  if (SHM_ENABLED) {
+    if (shm_initialize() == 0) {
+      shm_thread.poll = network_poll_shm;
+      shm_thread.sock = -1;
+      shm_thread.gro_buffer = NULL;
+      shm_thread.ready = mpsc_queue_new(network_doorbell, &shm_thread);
+      if (shm_thread.ready == NULL || packet_pool_initialize(&shm_thread.pool) == -1) {
+        kprintf("Error: could not allocate the network buffers.\n");
+        return -1;
+      }
+      start_network_poll(mini_network_handler, &shm_thread);
+    }
+    else if (DEBUG)
+      kprintf("NET:no shared-memory inbox, using UDP only.\n");
+  }
 
   return 0;
 }
@@ -10,8 +10,13 @@
  *      same or different hosts.
  */
 
+#include <sys/uio.h>
+
 #define MAX_NETWORK_PKT_SIZE    8192
 
+/* maximum number of parts that network_send_pktv gathers into one packet */
+#define NETWORK_MAX_IOVEC       16
+
 /* network_address_t's should be treated as opaque types. See functions below */
 typedef unsigned int network_address_t[2];
 
@@ -19,17 +24,32 @@ typedef unsigned int network_address_t[2];
 *  Network interrupt handler                                                   *
 *******************************************************************************/
 
-/* the argument to the network interrupt handler */
+/* the argument to the network interrupt handler. Packets live in a fixed pool
+ * of right-sized buffers owned by the network layer: buffer points to at
+ * least size bytes of packet data (and never more than MAX_NETWORK_PKT_SIZE).
+ * Packets must never be passed to free(); see network_packet_release. */
 typedef struct {
     network_address_t sender;
-    char buffer[MAX_NETWORK_PKT_SIZE];
+    char* buffer;
     int size;
 } network_interrupt_arg_t;
 
-/* the type of an interrupt handler.  These functions are responsible for freeing
- * the argument that is passed in */
+/* the type of an interrupt handler.  These functions are responsible for
+ * releasing the argument that is passed in */
 typedef void (*network_handler_t)(network_interrupt_arg_t *arg);
 
+/*
+ * Packets are reference counted and start out with a single reference,
+ * owned by the interrupt handler. network_packet_hold takes an additional
+ * reference; network_packet_release drops one, and the buffer goes back to
+ * the pool when the last reference is dropped. Both may be called from any
+ * thread, including interrupt handlers. A handler may move buffer past the
+ * headers it has dealt with (and take them off size); it is put back when the
+ * packet returns to the pool.
+ */
+void network_packet_hold(network_interrupt_arg_t* packet);
+void network_packet_release(network_interrupt_arg_t* packet);
+
 /*
  * network_initialize should be called before clock interrupts start
  * happening (or with clock interrupts disabled).  The initialization
@@ -51,6 +71,97 @@ int network_initialize(network_handler_t network_handler);
  */
 void network_udp_ports(short myportnum, short otherportnum);
 
+/*
+ * The network emulator. While it is enabled every packet that is sent is
+ * subject to, in order: burst loss following a two-state Gilbert-Elliott
+ * model (loss_good in the good state, loss_bad in the bad one, moving
+ * between them with probabilities p_good_to_bad and p_bad_to_good per
+ * packet), duplication, a per-destination queue of at most queue_limit
+ * packets (tail drop; 0 for no limit), a bandwidth cap (in kbit/s; 0 for
+ * none) and a one-way delay drawn from the given distribution around
+ * delay_ms with a spread of jitter_ms. With probability reorder_rate a
+ * packet skips the delay and overtakes the packets ahead of it.
+ *
+ * Emulated packets are delivered by a dedicated thread through the UDP
+ * socket. The parameters can be changed at any time.
+ *
+ * The emulator keeps state for up to 65536 destinations. Packets to any
+ * more than that, or sent when memory runs out, are sent as if the
+ * emulator was off, and counted in unemulated.
+ */
+enum { NETWORK_DELAY_CONSTANT = 0, NETWORK_DELAY_UNIFORM,
+       NETWORK_DELAY_NORMAL, NETWORK_DELAY_PARETO };
+
+typedef struct {
+    double delay_ms;
+    double jitter_ms;
+    int distribution;
+    double bandwidth_kbps;
+    int queue_limit;
+    double reorder_rate;
+    double duplication_rate;
+    double loss_good;
+    double loss_bad;
+    double p_good_to_bad;
+    double p_bad_to_good;
+} network_emulator_params_t;
+
+typedef struct {
+    long long int sent;
+    long long int lost;
+    long long int tail_dropped;
+    long long int duplicated;
+    long long int reordered;
+    long long int queued;
+    long long int unemulated;
+} network_emulator_stats_t;
+
+/*
+ * Enable the emulator with the given parameters, or disable it if params
+ * is NULL (packets already in it are still delivered). Returns 0 on
+ * success, -1 on error.
+ */
+int network_emulator_set(const network_emulator_params_t* params);
+
+/* Get the counters of the emulator since the program started. */
+void network_emulator_get_stats(network_emulator_stats_t* stats);
+
+/*
+ * Fault schedules. Every loss, duplication, reordering and delay decision
+ * made by the synthetic network and the emulator is drawn from a generator
+ * of the destination's own, seeded from the seed given here (the default
+ * is fixed), so that a run can be reproduced.
+ *
+ * network_fault_record logs every decision from then on to a compact
+ * binary file; network_fault_replay reads such a file and applies the same
+ * decisions again, to each destination in the order they were logged,
+ * whatever the timing of the new run. Both return 0 on success and -1 if
+ * the file cannot be used. network_fault_desyncs counts the decisions a
+ * replayed run needed that were not in the file, and had to be drawn live.
+ */
+void network_fault_seed(unsigned int seed);
+int network_fault_record(const char* filename);
+int network_fault_replay(const char* filename);
+long long int network_fault_desyncs();
+
+/*
+ * Ask the kernel to coalesce consecutive datagrams from the same sender
+ * (UDP GRO) before they reach the network poll thread, which splits them
+ * back into one packet per segment. Must be called before
+ * network_initialize; ignored where the kernel does not support it.
+ */
+void network_set_gro(int enabled);
+
+/*
+ * Receive on k sockets that share our UDP port through SO_REUSEPORT, each
+ * drained by its own poll thread, instead of on one. The kernel picks the
+ * socket by hashing the source address and port, so the packets of one
+ * sender stay in order. Must be called before network_initialize; k is
+ * capped at 16. Note that while this is on, another process of the same
+ * user can bind the same port without an error.
+ */
+void network_set_receive_sockets(int k);
+
 
 /*******************************************************************************
 *  Functions for sending packets                                               *
@@ -59,12 +170,95 @@ void network_udp_ports(short myportnum, short otherportnum);
 /*
  * network_send_pkt returns the number of bytes sent if it was able to
  * successfully send the data.  Returns -1 otherwise.
+ *
+ * Packets sent to our own address (see network_address_is_local) do not
+ * go through the kernel: they are run through the network handler before
+ * the send returns. Synthetic loss and duplication still apply.
  */
 int
 network_send_pkt(const network_address_t dest_address,
 		 int hdr_len, const char * hdr,
 		 int  data_len, const char * data);
 
+/*
+ * network_send_pktv sends the iovcnt parts described by iov, in order, as a
+ * single packet. The parts are gathered directly from the caller's memory
+ * without being copied, which is useful for multi-part headers. At most
+ * NETWORK_MAX_IOVEC parts may be given. Returns the number of bytes sent,
+ * or -1 (or 0 for a malformed packet) otherwise, like network_send_pkt.
+ */
+int
+network_send_pktv(const network_address_t dest_address,
+                  const struct iovec* iov, int iovcnt);
+
+
+/*
+ * network_send_segments sends data_len bytes of data as consecutive packets,
+ * each made of a header followed by the next seg_len bytes of data (the last
+ * one may be shorter). hdrs holds one hdr_len-byte header per packet, back to
+ * back, e.g. copies of a template with the sequence numbers filled in.
+ * Where the kernel supports UDP segmentation offload the packets are handed
+ * over as a few large super-packets; otherwise they are sent one by one.
+ * Returns the number of bytes (headers included) sent, or -1 on error.
+ */
+int
+network_send_segments(const network_address_t dest_address,
+                      int hdr_len, const char* hdrs,
+                      int seg_len, int data_len, const char* data);
+
+/*
+ * A network_batch_t queues outgoing packets, possibly to different
+ * destinations, so that they can be handed to the kernel in one system call.
+ * Packets are copied when they are queued. A batch is flushed automatically
+ * when it is full; it is not safe to share a batch between threads without
+ * disabling interrupts.
+ *
+ * Packets sent with network_send_pkt or network_send_pktv from inside the
+ * network interrupt handler are batched this way automatically, and flushed
+ * after the handler has run on every packet that arrived in the same burst.
+ */
+typedef struct network_batch network_batch_t;
+
+/* Return an empty batch, or NULL on error. */
+network_batch_t* network_batch_new();
+
+/*
+ * Queue a packet on the batch. Synthetic loss and duplication apply here.
+ * Returns hdr_len+data_len if the packet was queued, or -1 if a flush to
+ * make room failed (0 for a malformed packet).
+ */
+int network_batch_add(network_batch_t* batch,
+                      const network_address_t dest_address,
+                      int hdr_len, const char* hdr,
+                      int data_len, const char* data);
+
+/* Vectored version of network_batch_add, see network_send_pktv. */
+int network_batch_addv(network_batch_t* batch,
+                       const network_address_t dest_address,
+                       const struct iovec* iov, int iovcnt);
+
+/*
+ * Send every packet queued on the batch and empty it. Returns the number
+ * of packets sent, or -1 if sending failed, in which case the packets that
+ * had not been sent yet are dropped.
+ */
+int network_send_batch(network_batch_t* batch);
+
+/* Return the number of packets waiting on the batch. */
+int network_batch_length(network_batch_t* batch);
+
+/* Free a batch. Packets still queued on it are dropped. */
+void network_batch_free(network_batch_t* batch);
+
+/*
+ * network_bcast_pkt sends one packet to every neighbour of this host in the
+ * broadcast topology, or to the whole local network, if broadcast support
+ * was built in (BCAST_ENABLED in network.c); network_bcast_enabled says
+ * whether it was. Returns the number of bytes sent, or -1 on error.
+ */
+int network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data);
+int network_bcast_enabled();
+
 
 /*******************************************************************************
 *  Functions for working with network addresses                                *
@@ -78,6 +272,19 @@ network_send_pkt(const network_address_t dest_address,
  */
 void network_get_my_address(network_address_t my_address);
 
+/*
+ * Returns nonzero if packets sent to the address would come back to this
+ * address space, i.e. it names our UDP port on this host.
+ */
+int network_address_is_local(const network_address_t address);
+
+/*
+ * Returns nonzero if the address names another UDP port on this host.
+ * Packets to another PortOS process on this host are copied through a
+ * shared-memory ring instead of a socket, when that process has one.
+ */
+int network_address_is_colocated(const network_address_t address);
+
 /* look up the given host and return the corresponding network address.
  * Returns TODO
  */
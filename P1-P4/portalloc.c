@@ -0,0 +1,142 @@
+/*****
+ * Port number allocator implementation.
+ *
+ */
+#include "portalloc.h"
+#include "interrupts.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define WORD_BITS 64
+
+struct port_allocator {
+  int first;
+  int count;
+  int n_free;
+  int cursor;                                  // where the next search starts
+  uint64_t summary[PORTALLOC_SUMMARY_WORDS];   // bit w: words[w] has a free number
+  uint64_t words[];                            // bit i: number first + i is free
+};
+
+static inline int ffs64(uint64_t word)
+{
+  return __builtin_ctzll(word);
+}
+
+/* mask of the bits at or above bit in a word */
+static inline uint64_t bits_from(int bit)
+{
+  return ~(uint64_t) 0 << bit;
+}
+
+port_allocator_t *port_allocator_new(int first, int count)
+{
+  int n_words = (count + WORD_BITS - 1) / WORD_BITS;
+
+  if (count <= 0 || n_words > PORTALLOC_SUMMARY_WORDS * WORD_BITS) {
+    return NULL;
+  }
+
+  port_allocator_t *allocator =
+    (port_allocator_t *) calloc(1, sizeof(port_allocator_t) + n_words * sizeof(uint64_t));
+  if (!allocator) {
+    return NULL;
+  }
+
+  allocator->first = first;
+  allocator->count = count;
+  allocator->n_free = count;
+  allocator->cursor = 0;
+  for (int i = 0; i < count; i++) {
+    allocator->words[i / WORD_BITS] |= (uint64_t) 1 << (i % WORD_BITS);
+  }
+  for (int w = 0; w < n_words; w++) {
+    allocator->summary[w / WORD_BITS] |= (uint64_t) 1 << (w % WORD_BITS);
+  }
+  return allocator;
+}
+
+/*
+ * Find the first word at or after word w that has a free number, through
+ * the summary. Returns -1 if there is none.
+ */
+static int next_word(port_allocator_t *allocator, int w)
+{
+  int n_words = (allocator->count + WORD_BITS - 1) / WORD_BITS;
+  int s = w / WORD_BITS;
+
+  if (w >= n_words) {
+    return -1;
+  }
+  uint64_t bits = allocator->summary[s] & bits_from(w % WORD_BITS);
+  while (!bits) {
+    if (++s >= PORTALLOC_SUMMARY_WORDS) {
+      return -1;
+    }
+    bits = allocator->summary[s];
+  }
+  return s * WORD_BITS + ffs64(bits);
+}
+
+/* Find the first free number at or after i. Returns -1 if there is none. */
+static int next_free(port_allocator_t *allocator, int i)
+{
+  if (i >= allocator->count) {
+    return -1;
+  }
+  int w = i / WORD_BITS;
+  uint64_t bits = allocator->words[w] & bits_from(i % WORD_BITS);
+  if (bits) {
+    return w * WORD_BITS + ffs64(bits);
+  }
+  w = next_word(allocator, w + 1);
+  return (w == -1) ? -1 : w * WORD_BITS + ffs64(allocator->words[w]);
+}
+
+int port_allocator_get(port_allocator_t *allocator)
+{
+  assert(allocator);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+  int i = next_free(allocator, allocator->cursor);
+  if (i == -1) {
+    i = next_free(allocator, 0);
+  }
+  if (i == -1) {
+    set_interrupt_level(old_level);
+    return -1;
+  }
+
+  int w = i / WORD_BITS;
+  allocator->words[w] &= ~((uint64_t) 1 << (i % WORD_BITS));
+  if (!allocator->words[w]) {
+    allocator->summary[w / WORD_BITS] &= ~((uint64_t) 1 << (w % WORD_BITS));
+  }
+  allocator->n_free--;
+  allocator->cursor = (i + 1 < allocator->count) ? i + 1 : 0;
+
+  set_interrupt_level(old_level);
+  return allocator->first + i;
+}
+
+void port_allocator_put(port_allocator_t *allocator, int port)
+{
+  assert(allocator);
+  int i = port - allocator->first;
+  assert(i >= 0 && i < allocator->count);
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int w = i / WORD_BITS;
+  assert(!(allocator->words[w] & ((uint64_t) 1 << (i % WORD_BITS))));
+  allocator->words[w] |= (uint64_t) 1 << (i % WORD_BITS);
+  allocator->summary[w / WORD_BITS] |= (uint64_t) 1 << (w % WORD_BITS);
+  allocator->n_free++;
+  set_interrupt_level(old_level);
+}
+
+int port_allocator_free_count(port_allocator_t *allocator)
+{
+  assert(allocator);
+  return allocator->n_free;
+}
@@ -0,0 +1,43 @@
+/*
+ * Port number allocator
+ */
+#ifndef __PORTALLOC_H__
+#define __PORTALLOC_H__
+
+/*
+ * port_allocator_t is a pointer to an internally maintained data structure.
+ * It hands out the numbers of a contiguous range of ports in increasing
+ * order, wrapping around at the end of the range and skipping the numbers
+ * still in use, so that a number is not reused until the rest of the range
+ * has had its turn.
+ *
+ * Free numbers are kept in a bitmap of 64-bit words, with a summary bitmap
+ * of the words that have any free number, so that both port_allocator_get
+ * and port_allocator_put take a handful of find-first-set instructions
+ * however full the range is. The summary has one bit per word, so a range
+ * may hold at most 64 * 64 * PORTALLOC_SUMMARY_WORDS numbers.
+ *
+ * All functions disable interrupts while they touch an allocator, so they
+ * may be used from interrupt handlers. They must not be used from other
+ * pthreads.
+ */
+#define PORTALLOC_SUMMARY_WORDS 16
+
+typedef struct port_allocator port_allocator_t;
+
+/* Create an allocator of the count numbers starting at first, all free. */
+port_allocator_t* port_allocator_new(int first, int count);
+
+/*
+ * Take the next free number, at or after the one following the number
+ * last handed out. Returns -1 if every number is in use.
+ */
+int port_allocator_get(port_allocator_t* allocator);
+
+/* Give a number back. */
+void port_allocator_put(port_allocator_t* allocator, int port);
+
+/* Return the number of free numbers left. */
+int port_allocator_free_count(port_allocator_t* allocator);
+
+#endif /*__PORTALLOC_H__*/
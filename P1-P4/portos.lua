@@ -0,0 +1,104 @@
+--
+-- Wireshark dissector for the PortOS headers (miniheader.h), for reading
+-- the captures written by network_capture_start:
+--
+--     wireshark -X lua_script:portos.lua capture.pcapng
+--
+-- Packets are recognised by their first byte, the protocol ('1' datagram,
+-- '2' stream, '4' reliable datagram), on any UDP port. The addresses inside the headers are the
+-- network_address_t words packed on an x86 host, which is why the IP
+-- address and the UDP port come out little-endian.
+--
+
+local portos = Proto("portos", "PortOS")
+
+local protocols = { [0x31] = "Minidatagram", [0x32] = "Ministream", [0x34] = "Minirdp",
+                    [0x35] = "Minigroup" }
+local message_types = { [0x31] = "SYN", [0x32] = "SYNACK", [0x33] = "ACK", [0x34] = "FIN" }
+local rdp_types = { [0x31] = "DATA", [0x32] = "ACK" }
+
+local f = portos.fields
+f.protocol = ProtoField.uint8("portos.protocol", "Protocol", base.HEX, protocols)
+f.src_host = ProtoField.ipv4("portos.src_host", "Source host")
+f.src_udp = ProtoField.uint16("portos.src_udp", "Source UDP port")
+f.src_port = ProtoField.uint16("portos.src_port", "Source port")
+f.dst_host = ProtoField.ipv4("portos.dst_host", "Destination host")
+f.dst_udp = ProtoField.uint16("portos.dst_udp", "Destination UDP port")
+f.dst_port = ProtoField.uint16("portos.dst_port", "Destination port")
+f.msg_type = ProtoField.uint8("portos.msg_type", "Message type", base.HEX, message_types)
+f.seq = ProtoField.uint32("portos.seq", "Sequence number")
+f.ack = ProtoField.uint32("portos.ack", "Acknowledgment number")
+f.rdp_type = ProtoField.uint8("portos.rdp_type", "Message type", base.HEX, rdp_types)
+f.flow_id = ProtoField.uint32("portos.flow_id", "Flow id", base.HEX)
+f.window_base = ProtoField.uint32("portos.window_base", "Window base")
+f.ack_bits = ProtoField.uint64("portos.ack_bits", "Acknowledged", base.HEX)
+f.group_id = ProtoField.uint32("portos.group_id", "Group id")
+
+local HEADER_LEN = 21            -- sizeof(mini_header_t)
+local RELIABLE_HEADER_LEN = 30   -- sizeof(mini_header_reliable_t)
+local RDP_HEADER_LEN = 42        -- sizeof(mini_header_rdp_t)
+local GROUP_HEADER_LEN = 25      -- sizeof(mini_header_group_t)
+
+-- an 8 byte packed network_address_t followed by a 2 byte port
+local function address(tree, buf, offset, host, udp, port)
+  tree:add_le(host, buf(offset, 4))
+  tree:add_le(udp, buf(offset + 6, 2))
+  tree:add(port, buf(offset + 8, 2))
+end
+
+function portos.dissector(buf, pinfo, root)
+  if buf:len() < HEADER_LEN then
+    return false
+  end
+  local protocol = buf(0, 1):uint()
+  if protocols[protocol] == nil then
+    return false
+  end
+  local header_len = (protocol == 0x32) and RELIABLE_HEADER_LEN
+                     or (protocol == 0x34) and RDP_HEADER_LEN
+                     or (protocol == 0x35) and GROUP_HEADER_LEN or HEADER_LEN
+  if buf:len() < header_len then
+    return false
+  end
+
+  local tree = root:add(portos, buf(0, header_len))
+  tree:add(f.protocol, buf(0, 1))
+  address(tree, buf, 1, f.src_host, f.src_udp, f.src_port)
+  address(tree, buf, 11, f.dst_host, f.dst_udp, f.dst_port)
+
+  local info = string.format("%s %d -> %d", protocols[protocol],
+                             buf(9, 2):uint(), buf(19, 2):uint())
+  if protocol == 0x32 then
+    local msg_type = buf(21, 1):uint()
+    tree:add(f.msg_type, buf(21, 1))
+    tree:add(f.seq, buf(22, 4))
+    tree:add(f.ack, buf(26, 4))
+    info = string.format("%s %s seq=%d ack=%d", info,
+                         message_types[msg_type] or "?",
+                         buf(22, 4):uint(), buf(26, 4):uint())
+  elseif protocol == 0x34 then
+    local rdp_type = buf(21, 1):uint()
+    tree:add(f.rdp_type, buf(21, 1))
+    tree:add(f.flow_id, buf(22, 4))
+    tree:add(f.seq, buf(26, 4))
+    tree:add(f.window_base, buf(30, 4))
+    tree:add(f.ack_bits, buf(34, 8))
+    if rdp_type == 0x32 then
+      info = string.format("%s ACK base=%d", info, buf(30, 4):uint())
+    else
+      info = string.format("%s DATA seq=%d", info, buf(26, 4):uint())
+    end
+  elseif protocol == 0x35 then
+    tree:add(f.group_id, buf(21, 4))
+    info = string.format("%s group=%d", info, buf(21, 4):uint())
+  end
+
+  pinfo.cols.protocol = "PortOS"
+  pinfo.cols.info = info .. string.format(" len=%d", buf:len() - header_len)
+  if buf:len() > header_len then
+    Dissector.get("data"):call(buf(header_len):tvb(), pinfo, root)
+  end
+  return true
+end
+
+portos:register_heuristic("udp", portos.dissector)
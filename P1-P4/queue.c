@@ -3,6 +3,7 @@
  *
  */
 #include "queue.h"
+#include "slab.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
@@ -23,11 +24,27 @@ struct queue {
   int count;
 };
 
+//Object cache for queue nodes, created on first use since queues are
+//needed before any subsystem is initialized
+static slab_cache_t *qnode_cache = NULL;
+
+/*
+ * Allocate a queue node from the node cache
+ */
+static qnode *alloc_qnode()
+{
+  if (!qnode_cache) {
+    qnode_cache = slab_cache_create("qnode", sizeof(qnode), NULL);
+    assert(qnode_cache);
+  }
+  return (qnode *) slab_alloc(qnode_cache);
+}
+
 /*
  * Create a new queue node with default priority 0
  */
 qnode *create_qnode(void *ndata) {
-  qnode *node = (qnode *) malloc(sizeof(qnode));
+  qnode *node = alloc_qnode();
   assert(node);
   node->data = ndata;
   node->priority = 0;
@@ -40,7 +57,7 @@ qnode *create_qnode(void *ndata) {
  */
 qnode *creat_qnode_priority(void *ndata, long long int p)
 {
-  qnode *node = (qnode *) malloc(sizeof(qnode));
+  qnode *node = alloc_qnode();
   assert(node);
   node->data = ndata;
   node->priority = p;
@@ -124,7 +141,7 @@ queue_dequeue(queue_t *queue, void **item) {
     queue->front = first->next;
     //printf("Just before failing\n");
     *item = first->data;
-    free (first);
+    slab_free(qnode_cache, first);
     first = NULL;
     // if there was only one element in the queue which has now been removed
     if (!queue->front) {
@@ -205,10 +222,13 @@ queue_delete(queue_t *queue, void *item) {
       if (curr == queue->front) { // the item to be deleted is first in queue
         queue->front = curr->next;
       }
+      else {
+        prev->next = curr->next;
+      }
       if (curr == queue->rear) { // the item to be deleted is last in queue
         queue->rear = prev;
       }      
-      free (curr);
+      slab_free(qnode_cache, curr);
       queue->count--;
       return 0;
     }
@@ -290,3 +310,167 @@ void* queue_get_data(qnode *node)
   return node->data;
 }
 
+
+/*
+ * Intrusive MPSC queue (Vyukov). Producers swing head to their node with a
+ * single atomic exchange and then link the previous head to it, so a push
+ * never loops or blocks. The consumer walks from tail. A stub node keeps the
+ * list non-empty so that producers and the consumer never touch the same
+ * pointer. pending is 1 from the moment the doorbell is rung until the
+ * consumer has seen the queue empty.
+ */
+struct mpsc_queue {
+  mpsc_node_t *head;
+  mpsc_node_t *tail;
+  mpsc_node_t stub;
+  int pending;
+  mpsc_doorbell_t doorbell;
+  void *doorbell_arg;
+};
+
+/*
+ * Return an empty MPSC queue.
+ */
+mpsc_queue_t *mpsc_queue_new(mpsc_doorbell_t doorbell, void *arg)
+{
+  mpsc_queue_t *queue = (mpsc_queue_t *) malloc(sizeof(mpsc_queue_t));
+  if (!queue) {
+    return NULL;
+  }
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+  queue->pending = 0;
+  queue->doorbell = doorbell;
+  queue->doorbell_arg = arg;
+  return queue;
+}
+
+/*
+ * Link a node at the head of the list. Between the exchange and the store
+ * the list is briefly broken, which the consumer detects and treats as empty.
+ */
+static void mpsc_queue_link(mpsc_queue_t *queue, mpsc_node_t *node)
+{
+  __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+  mpsc_node_t *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Push a node and ring the doorbell if nobody has rung it since the
+ * consumer last drained the queue.
+ */
+void mpsc_queue_push(mpsc_queue_t *queue, mpsc_node_t *node)
+{
+  assert(queue && node);
+  mpsc_queue_link(queue, node);
+  if (__atomic_exchange_n(&queue->pending, 1, __ATOMIC_SEQ_CST) == 0 && queue->doorbell) {
+    queue->doorbell(queue->doorbell_arg);
+  }
+}
+
+/*
+ * Chain the nodes together first, then splice the chain in exactly like a
+ * single node: swing head to the last node and link the old head to the first.
+ */
+void mpsc_queue_push_batch(mpsc_queue_t *queue, mpsc_node_t **nodes, int count)
+{
+  assert(queue && (nodes || count == 0));
+  if (count <= 0) {
+    return;
+  }
+
+  for (int i = 0; i < count - 1; i++) {
+    nodes[i]->next = nodes[i + 1];
+  }
+  __atomic_store_n(&nodes[count - 1]->next, NULL, __ATOMIC_RELAXED);
+  mpsc_node_t *prev = __atomic_exchange_n(&queue->head, nodes[count - 1], __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, nodes[0], __ATOMIC_RELEASE);
+
+  if (__atomic_exchange_n(&queue->pending, 1, __ATOMIC_SEQ_CST) == 0 && queue->doorbell) {
+    queue->doorbell(queue->doorbell_arg);
+  }
+}
+
+/*
+ * Take the oldest node off the list without touching the doorbell state.
+ * Return -1 if the list is empty or a producer is half way through a push.
+ */
+static int mpsc_queue_try_pop(mpsc_queue_t *queue, mpsc_node_t **node)
+{
+  mpsc_node_t *tail = queue->tail;
+  mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  // skip over the stub
+  if (tail == &queue->stub) {
+    if (!next) {
+      return -1;
+    }
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next) {
+    queue->tail = next;
+    *node = tail;
+    return 0;
+  }
+
+  // tail is the last linked node; if it is not the head, a producer has
+  // exchanged head but not yet linked its node
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+
+  // put the stub back behind the last node so that it can be handed out
+  mpsc_queue_link(queue, &queue->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    queue->tail = next;
+    *node = tail;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Pop the oldest node. When the queue looks empty the doorbell is re-armed
+ * and the queue checked once more, so a push racing with the re-arm either
+ * is seen here or rings the doorbell itself.
+ */
+int mpsc_queue_pop(mpsc_queue_t *queue, mpsc_node_t **node)
+{
+  assert(queue && node);
+
+  if (mpsc_queue_try_pop(queue, node) == 0) {
+    return 0;
+  }
+
+  __atomic_store_n(&queue->pending, 0, __ATOMIC_SEQ_CST);
+  if (mpsc_queue_try_pop(queue, node) == 0) {
+    // the consumer is still running, so take the doorbell back; if a
+    // producer beat us to it we just get one spurious ring
+    __atomic_store_n(&queue->pending, 1, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+
+  *node = NULL;
+  return -1;
+}
+
+/*
+ * Free the MPSC queue and return 0 (success) or -1 (failure).
+ */
+int mpsc_queue_free(mpsc_queue_t *queue)
+{
+  assert(queue);
+  // non-empty queue should error
+  if (queue->tail != &queue->stub || queue->stub.next ||
+      __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) != &queue->stub) {
+    return -1;
+  }
+  free(queue);
+  return 0;
+}
@@ -4,6 +4,8 @@
 #ifndef __QUEUE_H__
 #define __QUEUE_H__
 
+#include <stddef.h>
+
 /*
  * queue_t is a pointer to an internally maintained data structure.
  * Clients of this package do not need to know how queues are
@@ -71,4 +73,62 @@ int queue_insert_sorted(queue_t *queue, void *item, long long int p);
  */
 void* queue_front(queue_t *queue);
 
+/*
+ * Multi-producer/single-consumer queue for handing items from other kernel
+ * threads (the network poll thread, disk or timer threads, ...) to the
+ * minithreads.  Pushing is wait-free and may be done from any pthread;
+ * popping must only ever be done by one minithread consumer at a time
+ * (with interrupts disabled if an interrupt handler also pops).
+ *
+ * The queue is intrusive: each item embeds an mpsc_node_t, so pushing never
+ * allocates. Use mpsc_entry to get back the enclosing item.
+ */
+typedef struct mpsc_queue mpsc_queue_t;
+
+typedef struct mpsc_node {
+  struct mpsc_node *next;
+} mpsc_node_t;
+
+#define mpsc_entry(node, type, member) \
+  ((type *) ((char *) (node) - offsetof(type, member)))
+
+/*
+ * The doorbell is called by a producer, on the producer's thread, when the
+ * queue goes from empty to non-empty, i.e. at most once until the consumer
+ * has drained the queue again. It is expected to wake the consumer, for
+ * example with send_interrupt().
+ */
+typedef void (*mpsc_doorbell_t)(void*);
+
+/*
+ * Return an empty MPSC queue with the given doorbell (which may be NULL).
+ * Returns NULL on error.
+ */
+mpsc_queue_t* mpsc_queue_new(mpsc_doorbell_t doorbell, void* arg);
+
+/*
+ * Push a node onto the queue. Safe to call from any thread.
+ */
+void mpsc_queue_push(mpsc_queue_t* queue, mpsc_node_t* node);
+
+/*
+ * Push count nodes, in order, with a single atomic exchange. The doorbell
+ * is rung at most once for the whole batch. Safe to call from any thread.
+ */
+void mpsc_queue_push_batch(mpsc_queue_t* queue, mpsc_node_t** nodes, int count);
+
+/*
+ * Pop the oldest node from the queue. Consumer only.
+ * Return 0 (success) and the node, or -1 (failure) and NULL if the queue is
+ * empty. Returning -1 re-arms the doorbell, so the consumer should keep
+ * popping until it gets -1 before it goes to sleep.
+ */
+int mpsc_queue_pop(mpsc_queue_t* queue, mpsc_node_t** node);
+
+/*
+ * Free the queue and return 0 (success) or -1 (failure).
+ * Failure cases include NULL queue and non-empty queue.
+ */
+int mpsc_queue_free(mpsc_queue_t* queue);
+
 #endif /*__QUEUE_H__*/
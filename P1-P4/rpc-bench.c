@@ -0,0 +1,113 @@
+/* RPC benchmark
+
+     measure how many calls per second a minirpc client gets answered by an
+     echo server in the same process, with 1, 8, 32 and 128 calls in flight
+     at a time: over the in-process loopback, or, if a loss rate is given,
+     through the network emulator, losing that fraction of the packets.
+
+     USAGE: ./rpc-bench <port> [<loss>]
+
+     port = udp port to listen on (and send to).
+     loss = fraction of the packets to lose, e.g. 0.05.
+*/
+
+#include "defs.h"
+#include "minithread.h"
+#include "minirpc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SERVER_PORT 50
+#define CLIENT_PORT 60
+#define WORKERS 4
+#define PROC_ECHO 1
+#define BUFFER_SIZE 64
+#define MAX_DEPTH 128
+#define LOSSLESS_CALLS 8192
+#define LOSSY_CALLS_PER_DEPTH 50
+
+double loss;
+
+/* answers with the request, its first byte changed */
+int
+echo(void* arg, const char* request, int request_len, char* response, int max_len) {
+    memcpy(response, request, request_len);
+    response[0]++;
+    return request_len;
+}
+
+void
+bench(minirpc_client_t* client, int depth) {
+    minirpc_call_t* calls[MAX_DEPTH];
+    char request[BUFFER_SIZE], expected[BUFFER_SIZE], response[BUFFER_SIZE];
+    int total = (loss > 0) ? LOSSY_CALLS_PER_DEPTH * depth : LOSSLESS_CALLS;
+    int done, i, len, ok = 0, failed = 0;
+    long long int start, ms;
+
+    start = currentTimeMillis();
+    for (done=0; done<total; done+=depth) {
+        for (i=0; i<depth; i++) {
+            sprintf(request, "a%d", done + i);
+            calls[i] = minirpc_call_start(client, PROC_ECHO, request, strlen(request) + 1, 0);
+        }
+        for (i=0; i<depth; i++) {
+            len = BUFFER_SIZE;
+            sprintf(expected, "b%d", done + i);
+            if (minirpc_call_wait(calls[i], response, &len) == MINIRPC_OK
+                && strcmp(response, expected) == 0)
+                ok++;
+            else
+                failed++;
+        }
+    }
+    ms = currentTimeMillis() - start;
+
+    printf("depth %3d: %5d calls, %d failed, %lld ms, %.0f calls/s\n",
+           depth, ok + failed, failed, ms, ok * 1000.0 / (ms > 0 ? ms : 1));
+}
+
+int
+run(int* arg) {
+    network_address_t addr;
+    network_emulator_params_t params;
+    minirpc_server_t* server;
+    minirpc_client_t* client;
+
+    network_get_my_address(addr);
+    server = minirpc_server_create(SERVER_PORT, WORKERS);
+    AbortOnCondition(server == NULL, "Could not create the server, exiting.");
+    minirpc_server_register(server, PROC_ECHO, echo, NULL);
+    client = minirpc_client_create(CLIENT_PORT, addr, SERVER_PORT);
+    AbortOnCondition(client == NULL, "Could not create the client, exiting.");
+
+    if (loss > 0) {
+        memset(&params, 0, sizeof(params));
+        params.loss_good = loss;
+        AbortOnCondition(network_emulator_set(&params) == -1,
+                         "Could not start the network emulator, exiting.");
+        printf("Losing %.1f%% of the packets.\n", loss * 100);
+    }
+
+    bench(client, 1);
+    bench(client, 8);
+    bench(client, 32);
+    bench(client, 128);
+
+    minirpc_client_destroy(client);
+    exit(0);
+    return 0;
+}
+
+int
+main(int argc, char** argv) {
+    short port;
+
+    AbortOnCondition(argc < 2, "USAGE: ./rpc-bench <port> [<loss>]");
+    port = atoi(argv[1]);
+    loss = (argc > 2) ? atof(argv[2]) : 0;
+    network_udp_ports(port, port);
+    minithread_system_initialize(run, NULL);
+    return -1;
+}
@@ -0,0 +1,187 @@
+/*****
+ * Slab allocator implementation.
+ *
+ */
+#include "slab.h"
+#include "interrupts.h"
+#include "machineprimitives.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define SLAB_ALIGN 16
+#define SLAB_BYTES 4096
+#define SLAB_MIN_OBJECTS 8
+
+#define SLAB_ROUND_UP(x) (((x) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+
+/*
+ * Every object is preceded by a slot header that links it into the free
+ * list of its cache. Keeping the link outside of the object is what lets
+ * a freed object keep its constructed state. While the object is allocated
+ * the link points back to the slot itself, which catches double frees.
+ */
+typedef struct slab_slot {
+  struct slab_slot *next;
+} slab_slot_t;
+
+#define SLAB_SLOT_HEADER SLAB_ROUND_UP(sizeof(slab_slot_t))
+
+struct slab_cache {
+  const char *name;
+  size_t object_size;
+  size_t slot_size;
+  int objects_per_slab;
+  slab_ctor_t ctor;
+  slab_slot_t *free_list;
+  int live;
+  int peak;
+  int slabs;
+  long long int allocs;
+  long long int frees;
+  uint64_t created;
+  struct slab_cache *next;
+};
+
+//List of all caches, used for reporting
+static slab_cache_t *caches = NULL;
+
+/*
+ * Allocate a new slab, construct all of its objects and put them on the
+ * free list of the cache. Called with interrupts disabled.
+ */
+static int slab_grow(slab_cache_t *cache)
+{
+  char *slab = (char *) malloc(cache->slot_size * cache->objects_per_slab);
+  if (!slab) {
+    return -1;
+  }
+
+  for (int i = cache->objects_per_slab - 1; i >= 0; i--) {
+    slab_slot_t *slot = (slab_slot_t *) (slab + i * cache->slot_size);
+    if (cache->ctor) {
+      cache->ctor((char *) slot + SLAB_SLOT_HEADER);
+    }
+    slot->next = cache->free_list;
+    cache->free_list = slot;
+  }
+  cache->slabs++;
+  return 0;
+}
+
+/*
+ * Create a cache of objects of the given size.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size, slab_ctor_t ctor)
+{
+  assert(name && size > 0);
+  slab_cache_t *cache = (slab_cache_t *) malloc(sizeof(slab_cache_t));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->name = name;
+  cache->object_size = size;
+  cache->slot_size = SLAB_SLOT_HEADER + SLAB_ROUND_UP(size);
+  cache->objects_per_slab = SLAB_BYTES / cache->slot_size;
+  if (cache->objects_per_slab < SLAB_MIN_OBJECTS) {
+    cache->objects_per_slab = SLAB_MIN_OBJECTS;
+  }
+  cache->ctor = ctor;
+  cache->free_list = NULL;
+  cache->live = 0;
+  cache->peak = 0;
+  cache->slabs = 0;
+  cache->allocs = 0;
+  cache->frees = 0;
+  cache->created = currentTimeMillis();
+
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  cache->next = caches;
+  caches = cache;
+  set_interrupt_level(old_level);
+  return cache;
+}
+
+/*
+ * Take an object off the free list, growing the cache if it is empty.
+ */
+void *slab_alloc(slab_cache_t *cache)
+{
+  assert(cache);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+  if (!cache->free_list && slab_grow(cache) == -1) {
+    set_interrupt_level(old_level);
+    return NULL;
+  }
+
+  slab_slot_t *slot = cache->free_list;
+  cache->free_list = slot->next;
+  slot->next = slot;
+  cache->allocs++;
+  cache->live++;
+  if (cache->live > cache->peak) {
+    cache->peak = cache->live;
+  }
+  set_interrupt_level(old_level);
+
+  return (char *) slot + SLAB_SLOT_HEADER;
+}
+
+/*
+ * Put an object back on the free list of its cache.
+ */
+void slab_free(slab_cache_t *cache, void *object)
+{
+  assert(cache);
+  if (!object) {
+    return;
+  }
+
+  slab_slot_t *slot = (slab_slot_t *) ((char *) object - SLAB_SLOT_HEADER);
+  assert(slot->next == slot);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  slot->next = cache->free_list;
+  cache->free_list = slot;
+  cache->frees++;
+  cache->live--;
+  set_interrupt_level(old_level);
+}
+
+/*
+ * Fill in the statistics of a cache.
+ */
+void slab_cache_get_stats(slab_cache_t *cache, slab_stats_t *stats)
+{
+  assert(cache && stats);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  stats->name = cache->name;
+  stats->object_size = cache->object_size;
+  stats->live = cache->live;
+  stats->peak = cache->peak;
+  stats->slabs = cache->slabs;
+  stats->allocs = cache->allocs;
+  stats->frees = cache->frees;
+  set_interrupt_level(old_level);
+
+  uint64_t elapsed = currentTimeMillis() - cache->created;
+  stats->alloc_rate = elapsed ? stats->allocs * 1000.0 / elapsed : 0.0;
+}
+
+/*
+ * Print one line of statistics per cache.
+ */
+void slab_print_stats()
+{
+  slab_stats_t stats;
+
+  printf("%-24s %8s %8s %8s %6s %12s %12s %12s\n", "cache", "size", "live",
+         "peak", "slabs", "allocs", "frees", "allocs/s");
+  for (slab_cache_t *cache = caches; cache; cache = cache->next) {
+    slab_cache_get_stats(cache, &stats);
+    printf("%-24s %8zu %8d %8d %6d %12lld %12lld %12.0f\n", stats.name,
+           stats.object_size, stats.live, stats.peak, stats.slabs,
+           stats.allocs, stats.frees, stats.alloc_rate);
+  }
+}
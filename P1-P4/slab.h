@@ -0,0 +1,69 @@
+/*
+ * Slab allocator (object caches) for fixed-size kernel objects
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/*
+ * slab_cache_t is a pointer to an internally maintained data structure.
+ * Each cache hands out objects of a single size, carved out of larger
+ * slabs that are allocated on demand and never given back.
+ *
+ * All functions disable interrupts while they touch a cache, so they may
+ * be used from interrupt handlers. They must not be used from other
+ * pthreads (e.g. the network poll thread).
+ */
+typedef struct slab_cache slab_cache_t;
+
+/*
+ * An optional constructor is run once on every object when its slab is
+ * allocated, not on every slab_alloc. Objects must be handed back to
+ * slab_free in their constructed state, so that expensive one-time setup
+ * (e.g. the wait list of a semaphore) survives being freed and reused.
+ */
+typedef void (*slab_ctor_t)(void*);
+
+/*
+ * Statistics kept for every cache. alloc_rate is in allocations per
+ * second since the cache was created.
+ */
+typedef struct slab_stats {
+  const char *name;
+  size_t object_size;
+  int live;
+  int peak;
+  int slabs;
+  long long int allocs;
+  long long int frees;
+  double alloc_rate;
+} slab_stats_t;
+
+/*
+ * Create a cache of objects of the given size. name is used for reporting
+ * and must stay valid for the lifetime of the cache. Returns NULL on error.
+ */
+slab_cache_t* slab_cache_create(const char* name, size_t size, slab_ctor_t ctor);
+
+/*
+ * Return an object from the cache, or NULL if memory is exhausted.
+ */
+void* slab_alloc(slab_cache_t* cache);
+
+/*
+ * Return an object to the cache it was allocated from.
+ */
+void slab_free(slab_cache_t* cache, void* object);
+
+/*
+ * Fill in the statistics of a cache.
+ */
+void slab_cache_get_stats(slab_cache_t* cache, slab_stats_t* stats);
+
+/*
+ * Print the statistics of every cache that has been created.
+ */
+void slab_print_stats();
+
+#endif /*__SLAB_H__*/
@@ -8,6 +8,7 @@
 #include "queue.h"
 #include "minithread.h"
 #include "interrupts.h"
+#include "slab.h"
 
 /*
  * You must implement the procedures and types defined in this interface.
@@ -23,25 +24,48 @@ struct semaphore {
   queue_t *wait_list;
 };
 
+//Object cache for semaphores. The wait list is built by the constructor and
+//stays with the semaphore when it is destroyed and reused.
+static slab_cache_t *semaphore_cache = NULL;
+
+/*
+ * Semaphore constructor, run once per cached object
+ */
+static void semaphore_construct(void *object) {
+  semaphore_t *sem = (semaphore_t *) object;
+  sem->count = 0;
+  sem->wait_list = queue_new();
+  assert(sem->wait_list);
+}
+
 /*
  *  Allocate a new semaphore.
  */
 semaphore_t* semaphore_create() {
-  semaphore_t *sem = (semaphore_t *)malloc(sizeof(semaphore_t));
+  if (!semaphore_cache) {
+    semaphore_cache = slab_cache_create("semaphore_t", sizeof(semaphore_t), semaphore_construct);
+    assert(semaphore_cache);
+  }
+  semaphore_t *sem = (semaphore_t *) slab_alloc(semaphore_cache);
   assert(sem);
   return sem;
 }
 
 /*
- *  Deallocate a semaphore.
+ *  Deallocate a semaphore. The wait list is kept for reuse.
  */
 void semaphore_destroy(semaphore_t *sem) {
   assert(sem);
   // since the wait_list of a semaphore is a critical section
   // disable interrupts before this
   interrupt_level_t old_level = set_interrupt_level(DISABLED);
-  queue_free(sem->wait_list);
-  free(sem);
+  // threads still blocked on a destroyed semaphore stay blocked; leave their
+  // wait list behind and give the cached object a fresh one
+  if (queue_length(sem->wait_list) != 0) {
+    sem->wait_list = queue_new();
+    assert(sem->wait_list);
+  }
+  slab_free(semaphore_cache, sem);
   set_interrupt_level(old_level);
 }
 
@@ -52,8 +76,6 @@ void semaphore_destroy(semaphore_t *sem) {
 void semaphore_initialize(semaphore_t *sem, int cnt) {
   assert(sem);
   sem->count = cnt;
-  sem->wait_list = queue_new();
-  assert(sem->wait_list);
 }
 
 /*
@@ -72,6 +94,27 @@ void semaphore_P(semaphore_t *sem) {
   set_interrupt_level(old_level);
 }
 
+/*
+ * P on the semaphore up to max times, blocking only for the first one
+ */
+int semaphore_P_many(semaphore_t *sem, int max) {
+  assert(sem && max > 0);
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  sem->count--;
+  if (sem->count < 0) {
+    queue_append(sem->wait_list, minithread_self());
+    minithread_stop();
+  }
+  // take whatever else is available in one go
+  int extra = (sem->count < max - 1) ? sem->count : max - 1;
+  if (extra < 0) {
+    extra = 0;
+  }
+  sem->count -= extra;
+  set_interrupt_level(old_level);
+  return extra + 1;
+}
+
 /*
  * V on the sempahore. If less than or equal to 0, then wake up thread and start it
  */
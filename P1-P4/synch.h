@@ -45,6 +45,15 @@ void semaphore_P(semaphore_t* sem);
  *  V on the sempahore.
  */
 void semaphore_V(semaphore_t* sem);
+
+/*
+ * semaphore_P_many(semaphore_t sem, int max)
+ *  P on the semaphore as many times as it allows without blocking, up
+ *  to max, but at least once, blocking for that one if need be. Returns
+ *  the number of times it was P'd.
+ */
+int semaphore_P_many(semaphore_t* sem, int max);
+
 int semaphore_get_count(semaphore_t *sem);
 
 #endif /*__SYNCH_H__*/